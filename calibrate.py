@@ -1,48 +1,244 @@
 #!/usr/bin/env python3
 import argparse
+import contextlib
+import json
+import os
 import re
+import selectors
 import sys
 import time
 from collections import namedtuple
+from concurrent.futures import ProcessPoolExecutor
 from math import floor, ceil
 from queue import Queue
 
-import pygame
-import pygame.font
-import evdev
-from evdev import ecodes
+import numpy as np
+
+# replaying a capture needs neither, the interactive calibration needs both
+try:
+    import pygame
+    import pygame.font
+except ImportError:
+    pygame = None
+try:
+    import evdev
+    from evdev import ecodes
+except ImportError:
+    evdev = None
 
 import logging
 
 log = logging.getLogger("guncon2-calibration")
 
 Postion = namedtuple("Postion", ["x", "y"])
+# gun state in the event frame of a button change, time is the event timestamp
+Shot = namedtuple("Shot", ["time", "pos", "offscreen"])
+
+Q16 = 1 << 16
+
+
+def burst_positions(burst):
+    """The positions of the (time, x, y) samples of a burst"""
+    return np.asarray(burst, dtype=float).reshape(-1, 3)[:, 1:]
+
+
+def reject_outliers(samples, threshold=3.0):
+    """Drop the samples of a burst that are further than threshold standard deviations from its median"""
+    pts = burst_positions(samples)
+    dist = np.linalg.norm(pts - np.median(pts, axis=0), axis=1)
+    # the MAD scaled to a standard deviation, allowing at least one unit of jitter
+    limit = max(threshold * 1.4826 * np.median(dist), 1.0)
+    return pts[dist <= limit]
+
+
+def fit_affine(bursts, targets):
+    """
+    Least squares fit of the affine transform mapping gun positions to screen positions, using the inlying samples of
+    the burst for each target. Every target has the same weight however many samples were kept for it. Returns the six
+    coefficients and the RMS error in screen pixels.
+    """
+    rows, screen, weights = [], [], []
+    for samples, target in zip(bursts, targets):
+        inliers = reject_outliers(samples)
+        rows.append(np.column_stack([inliers, np.ones(len(inliers))]))
+        screen.append(np.broadcast_to(np.asarray(target, dtype=float), inliers.shape))
+        weights.append(np.full(len(inliers), 1.0 / np.sqrt(len(inliers))))
+
+    a, b = np.vstack(rows), np.vstack(screen)
+    w = np.concatenate(weights)[:, None]
+    solution, _, rank, _ = np.linalg.lstsq(a * w, b * w, rcond=None)
+    if rank < 3:
+        raise np.linalg.LinAlgError("the samples are co-linear")
+
+    rms = float(np.sqrt(np.mean(np.sum((a @ solution - b) ** 2, axis=1))))
+    return list(solution[:, 0]) + list(solution[:, 1]), rms
+
+
+def fit_minmax(bursts, targets, width, height):
+    """The ABS_X and ABS_Y ranges that put the targets at their screen positions, as (x_min, x_max, y_min, y_max)"""
+    shots = [reject_outliers(burst).mean(axis=0) for burst in bursts]
+    targets_x = [target[0] for target in targets]
+    targets_y = [target[1] for target in targets]
+    shots_x = [float(shot[0]) for shot in shots]
+    shots_y = [float(shot[1]) for shot in shots]
+
+    # calculate the ratio between on-screen units and gun units for each axes
+    gsratio_x = (max(targets_x) - min(targets_x)) / (max(shots_x) - min(shots_x))
+    gsratio_y = (max(targets_y) - min(targets_y)) / (max(shots_y) - min(shots_y))
+
+    min_x = min(shots_x) - (min(targets_x) * gsratio_x)
+    max_x = max(shots_x) + ((width - max(targets_x)) * gsratio_x)
+
+    min_y = min(shots_y) - (min(targets_y) * gsratio_y)
+    max_y = max(shots_y) + ((height - max(targets_y)) * gsratio_y)
+
+    return int(min_x), int(max_x), int(min_y), int(max_y)
+
+
+def kernel_matrix(matrix, width, height):
+    """The calibration in the format of the driver's calibration_matrix attribute, Q16 fixed point"""
+    return " ".join(str(v) for v in [int(round(c * Q16)) for c in matrix] + [width, height])
+
+
+def store_entry(key, ranges, matrix=None, width=None, height=None):
+    """A calibration in the format of the driver's calibration module parameter"""
+    entry = " ".join([key] + [str(v) for v in ranges])
+    if matrix is not None:
+        entry += " " + kernel_matrix(matrix, width, height)
+    return entry
+
+
+def solve_record(record, matrix=False):
+    """Calibrate from a capture record, returns (key, store entry or None if it failed, rms error or None)"""
+    targets, bursts = record["targets"], record["bursts"]
+    width, height = record["width"], record["height"]
+    try:
+        if matrix:
+            coefficients, rms = fit_affine(bursts, targets)
+            # the screen mapping is applied to the raw positions, the ranges stay as they were captured
+            return record["key"], store_entry(record["key"], record["ranges"], coefficients, width, height), rms
+        return record["key"], store_entry(record["key"], fit_minmax(bursts, targets, width, height)), None
+    except (ZeroDivisionError, np.linalg.LinAlgError):
+        return record["key"], None, None
+
+
+def screen_targets(width, height):
+    """The corners and the center of the screen"""
+    margin = min(width, height) // 5
+    return [(margin, margin), (width - margin, margin), (width - margin, height - margin),
+            (margin, height - margin), (width // 2, height // 2)]
+
+
+class Calibration(object):
+    """Takes a burst of samples for each target in turn, from the event frames of one gun"""
+
+    def __init__(self, targets, samples, burst_time):
+        self.targets = targets
+        self.samples = samples
+        self.burst_time = burst_time
+        self.bursts = []
+        self.burst = None
+        self.burst_end = 0
+
+    @property
+    def done(self):
+        return len(self.bursts) == len(self.targets)
+
+    @property
+    def target(self):
+        return self.targets[len(self.bursts)]
+
+    @property
+    def sampling(self):
+        return self.burst is not None
+
+    def trigger(self, shot):
+        """Start a burst at a trigger pull, returns False for an off-screen shot"""
+        if self.done or self.sampling:
+            return True
+        if shot.offscreen:
+            return False
+        # hold the gun on the target while the burst is taken
+        self.burst = [(shot.time, shot.pos.x, shot.pos.y)]
+        self.burst_end = shot.time + self.burst_time
+        return True
+
+    def frame(self, shot):
+        if self.sampling and not shot.offscreen:
+            self.burst.append((shot.time, shot.pos.x, shot.pos.y))
+            if len(self.burst) >= self.samples or shot.time >= self.burst_end:
+                self._finish()
+
+    def tick(self, now):
+        # a gun held still sends no events, the event timestamps are CLOCK_REALTIME
+        if self.sampling and now >= self.burst_end:
+            self._finish()
+
+    def _finish(self):
+        log.info(f"Took {len(self.burst)} samples for target {self.target}")
+        self.bursts.append(self.burst)
+        self.burst = None
 
 
 class Guncon2(object):
     def __init__(self, device):
         self.device = device
         self.pos = Postion(0, 0)
+        self.offscreen = False
+        self._frame = {}
+        self._buttons = []
+        self._dropped = False
+        self.refresh_absinfo()
+
+    def fileno(self):
+        return self.device.fd
+
+    @property
+    def sysfs_path(self):
+        # the parent of the input device is the USB interface the driver is bound to
+        return os.path.join("/sys/class/input", os.path.basename(self.device.path), "device", "device")
+
+    @property
+    def key(self):
+        """Key of the gun in the driver's calibration store"""
+        with open(os.path.join(self.sysfs_path, "calibration_key")) as f:
+            return f.read().strip()
 
     @property
-    def absinfo(self):
-        return [self.device.absinfo(ecodes.ABS_X), self.device.absinfo(ecodes.ABS_Y)]
+    def ranges(self):
+        return [self.min_x, self.max_x, self.min_y, self.max_y]
+
+    def record(self, calibration, width, height):
+        """A capture record of a finished calibration"""
+        return {"key": self.key, "name": self.device.name, "phys": self.device.phys, "width": width,
+                "height": height, "ranges": self.ranges, "targets": calibration.targets,
+                "bursts": calibration.bursts}
+
+    def reset_matrix(self):
+        """Switch the screen mapping off, the calibration has to see the raw positions"""
+        with open(os.path.join(self.sysfs_path, "calibration_matrix"), "w") as f:
+            f.write("none")
+        self.refresh_absinfo()
+
+    def refresh_absinfo(self):
+        """Cache the axis ranges, they only change when the calibration is changed"""
+        self.absinfo = [self.device.absinfo(ecodes.ABS_X), self.device.absinfo(ecodes.ABS_Y)]
 
     @property
     def min_x(self):
-        return self.device.absinfo(ecodes.ABS_X).min
+        return self.absinfo[0].min
 
     @property
     def max_x(self):
-        return self.device.absinfo(ecodes.ABS_X).max
+        return self.absinfo[0].max
 
     @property
     def min_y(self):
-        return self.device.absinfo(ecodes.ABS_Y).min
+        return self.absinfo[1].min
 
     @property
     def max_y(self):
-        return self.device.absinfo(ecodes.ABS_Y).max
+        return self.absinfo[1].max
 
     @property
     def pos_normalised(self):
@@ -53,60 +249,86 @@ class Guncon2(object):
     def normalise(pos, min_, max_):
         return (pos - min_) / float(max_ - min_)
 
-    def update(self):
-        while True:
-            ev = self.device.read_one()
-            if ev:
-                if ev.type == ecodes.EV_ABS:
-                    if ev.code == ecodes.ABS_X:
-                        self.pos = Postion(ev.value, self.pos.y)
-                    elif ev.code == ecodes.ABS_Y:
-                        self.pos = Postion(self.pos.x, ev.value)
-                if ev.type == ecodes.EV_KEY:
-                    yield ev.code, ev.value
-            else:
-                break
-
-    def calibrate(self, targets, shots, width=320, height=240):
-        targets_x = [target[0] for target in targets]
-        targets_y = [target[1] for target in targets]
-        shots_x = [shot[0] for shot in shots]
-        shots_y = [shot[1] for shot in shots]
+    def _resync(self):
+        """Reload the state from the device after the kernel dropped events"""
+        self.pos = Postion(self.device.absinfo(ecodes.ABS_X).value, self.device.absinfo(ecodes.ABS_Y).value)
+        self.offscreen = bool(self.device.absinfo(ecodes.ABS_DISTANCE).value)
 
-        # calculate the ratio between on-screen units and gun units for each axes
+    def update(self):
+        """
+        Process the events that are waiting without blocking, call this when the device is readable. Yields
+        (shot, buttons) for each event frame, buttons is a list of the (button, value) changes in the frame.
+        """
         try:
-            gsratio_x = (max(targets_x) - min(targets_x)) / (max(shots_x) - min(shots_x))
-        except ZeroDivisionError:
-            log.error("Failed to calibrate X axis")
+            events = list(self.device.read())
+        except BlockingIOError:
             return
+
+        for ev in events:
+            if ev.type == ecodes.EV_SYN:
+                if ev.code == ecodes.SYN_DROPPED:
+                    # everything up to the next report is unreliable
+                    self._dropped = True
+                elif ev.code == ecodes.SYN_REPORT:
+                    if self._dropped:
+                        self._dropped = False
+                        self._resync()
+                    else:
+                        self.pos = Postion(self._frame.get(ecodes.ABS_X, self.pos.x),
+                                           self._frame.get(ecodes.ABS_Y, self.pos.y))
+                        self.offscreen = bool(self._frame.get(ecodes.ABS_DISTANCE, self.offscreen))
+                    yield Shot(ev.timestamp(), self.pos, self.offscreen), self._buttons
+                    self._frame.clear()
+                    self._buttons = []
+            elif self._dropped:
+                continue
+            elif ev.type == ecodes.EV_ABS:
+                self._frame[ev.code] = ev.value
+            elif ev.type == ecodes.EV_KEY:
+                self._buttons.append((ev.code, ev.value))
+
+    def calibrate(self, targets, bursts, width=320, height=240):
         try:
-            gsratio_y = (max(targets_y) - min(targets_y)) / (max(shots_y) - min(shots_y))
+            min_x, max_x, min_y, max_y = fit_minmax(bursts, targets, width, height)
         except ZeroDivisionError:
-            log.error("Failed to calibrate X axis")
-            return
-
-        min_x = min(shots_x) - (min(targets_x) * gsratio_x)
-        max_x = max(shots_x) + ((width - max(targets_x)) * gsratio_x)
-
-        min_y = min(shots_y) - (min(targets_y) * gsratio_y)
-        max_y = max(shots_y) + ((height - max(targets_y)) * gsratio_y)
+            log.error("Failed to calibrate, the shots are on one line")
+            return False
 
         # set the X and Y calibration values
-        self.device.set_absinfo(ecodes.ABS_X, min=int(min_x), max=int(max_x))
-        self.device.set_absinfo(ecodes.ABS_Y, min=int(min_y), max=int(max_y))
+        self.device.set_absinfo(ecodes.ABS_X, min=min_x, max=max_x)
+        self.device.set_absinfo(ecodes.ABS_Y, min=min_y, max=max_y)
+        self.refresh_absinfo()
 
         log.info(f"Calibration: x=({self.absinfo[0]}) y=({self.absinfo[1]})")
+        return True
+
+    def calibrate_matrix(self, targets, bursts, width=320, height=240):
+        """Load an affine screen mapping into the driver, this also corrects skew and keystone"""
+        try:
+            matrix, rms = fit_affine(bursts, targets)
+        except np.linalg.LinAlgError:
+            log.error("Failed to calibrate, the shots are co-linear")
+            return False
+
+        self.load_matrix(matrix, width, height)
+        log.info(f"Calibration: matrix=({kernel_matrix(matrix, width, height)}) rms error={rms:.2f}px")
+        return True
+
+    def load_matrix(self, matrix, width, height):
+        with open(os.path.join(self.sysfs_path, "calibration_matrix"), "w") as f:
+            f.write(kernel_matrix(matrix, width, height))
+        self.refresh_absinfo()
 
 
 WIDTH = 320
 HEIGHT = 240
+FRAME_TIME = 1.0 / 30
 TARGET_SIZE = 20
 WHITE = (255, 255, 255)
 GREY = (128, 128, 128)
 
 STATE_START = 0
 STATE_TARGET = 1
-STATE_DONE = 3
 
 
 def draw_target(size=10):
@@ -141,6 +363,221 @@ def blit_right(screen, image, pos):
     screen.blit(image, (pos[0] - (image.get_rect()[2]), pos[1]))
 
 
+def find_guncons():
+    return [Guncon2(device) for device in map(evdev.InputDevice, evdev.list_devices())
+            if device.name == "Namco GunCon 2"]
+
+
+def write_capture(path, records):
+    """Append calibration records to a capture file, one JSON object per line"""
+    with open(path, "a") as f:
+        for record in records:
+            f.write(json.dumps(record) + "\n")
+
+
+def read_captures(paths):
+    records = []
+    for path in paths:
+        with open(path) as f:
+            records.extend(json.loads(line) for line in f if line.strip())
+    return records
+
+
+def write_store(path, entries):
+    """Write the calibrations as a modprobe.d options line, or one entry per line to stdout for "-" """
+    if path == "-":
+        for entry in entries:
+            print(entry)
+        return
+    with open(path, "w") as f:
+        f.write(f'options guncon2 calibration="{";".join(entries)}"\n')
+    log.info(f"Wrote {len(entries)} calibrations to {path}")
+
+
+def run_interactive(args, guncon, width, height):
+    """Show the targets full screen and calibrate one gun, returns the capture records of each calibration"""
+    records = []
+
+    pygame.init()
+    pygame.font.init()
+    font = pygame.font.Font(None, 20)
+
+    start_text = font.render("Pull the TRIGGER to start calibration", True, WHITE)
+    start_text_w = start_text.get_rect()[2] // 2
+
+    pygame.display.set_caption("GunCon 2 calibration")
+
+    screen = pygame.display.set_mode((width, height), pygame.FULLSCREEN)
+    clock = pygame.time.Clock()
+
+    state = STATE_START
+    running = True
+    calibration = None
+
+    cursor = draw_cursor(color=(255, 255, 0))
+    target = draw_target()
+    onscreen_warning = 0
+
+    def on_trigger(shot):
+        nonlocal state, calibration, onscreen_warning
+
+        if state == STATE_START:
+            if args.matrix:
+                guncon.reset_matrix()
+            state = STATE_TARGET
+            calibration = Calibration(screen_targets(width, height), args.samples, args.burst_time / 1000.0)
+            log.info("Set target at: ({}, {})".format(*calibration.target))
+
+        elif state == STATE_TARGET:
+            onscreen_warning = 0 if calibration.trigger(shot) else time.time() + 1.0
+
+    def check_done():
+        nonlocal state
+
+        if state != STATE_TARGET or calibration.sampling:
+            return
+        if not calibration.done:
+            return
+
+        # record the ranges the samples were taken with, before the calibration changes them
+        record = guncon.record(calibration, width, height)
+        if args.matrix:
+            calibrated = guncon.calibrate_matrix(calibration.targets, calibration.bursts, width, height)
+        else:
+            calibrated = guncon.calibrate(calibration.targets, calibration.bursts, width, height)
+        if calibrated:
+            records.append(record)
+        state = STATE_START
+
+    # gun events are handled as soon as they arrive, the screen is only redrawn at the frame rate
+    selector = selectors.DefaultSelector()
+    selector.register(guncon, selectors.EVENT_READ)
+    next_frame = time.monotonic()
+    last_target = None
+
+    while running:
+        for _ in selector.select(max(0.0, next_frame - time.monotonic())):
+            for shot, buttons in guncon.update():
+                if state == STATE_TARGET:
+                    calibration.frame(shot)
+                for button, value in buttons:
+                    if button == ecodes.BTN_LEFT and value == 1:
+                        on_trigger(shot)
+
+        if state == STATE_TARGET:
+            calibration.tick(time.time())
+            if not calibration.done and calibration.target != last_target:
+                last_target = calibration.target
+                log.info("Set target at: ({}, {})".format(*last_target))
+        check_done()
+
+        now = time.monotonic()
+        if now < next_frame:
+            continue
+        next_frame = max(next_frame + FRAME_TIME, now)
+
+        for event in pygame.event.get():
+            if event.type == pygame.QUIT or (event.type == pygame.KEYDOWN and event.key == pygame.K_q):
+                running = False
+
+        screen.fill((80, 80, 80))
+
+        raw_x, raw_y = guncon.pos
+        cx, cy = int(guncon.pos_normalised.x * width), int(guncon.pos_normalised.y * height)
+
+        raw_pos_txt = font.render(f"({raw_x}, {raw_y})", True, (128, 128, 255))
+        cal_pos_txt = font.render(f"({cx}, {cy})", True, (128, 128, 255))
+
+        screen.blit(raw_pos_txt, (20, height - 40))
+        blit_right(screen, cal_pos_txt, (width - 20, height - 40))
+
+        if state == STATE_START:
+            screen.blit(start_text, ((width // 2) - start_text_w, height - 60))
+            if width > cx >= 0 and height > cy >= 0:  # on screen
+                screen.blit(cursor, (cx, cy))
+
+        elif state == STATE_TARGET and not calibration.done:
+            blit_center(screen, target, calibration.target)
+
+        if time.time() < onscreen_warning:
+            off_screen_txt = font.render("Warning: Shot Off-Screen", True, (255, 80, 80))
+            blit_center(screen, off_screen_txt, (width // 2, 60))
+
+        clock.tick()
+        fps = font.render(str(round(clock.get_fps())), True, (128, 128, 255))
+        screen.blit(fps, (20, 20))
+
+        pygame.display.flip()
+
+    return records
+
+
+def run_headless(args, guncons, width, height):
+    """
+    Calibrate every gun at once without a display, the targets are shown by something else (a test card or the
+    frontend's own calibration screen). Each gun shoots the targets in the order of screen_targets. Returns the capture
+    records of the guns that were calibrated.
+    """
+    records = []
+    burst_counts = {}
+    selector = selectors.DefaultSelector()
+    for guncon in guncons:
+        burst_counts[guncon.key] = 0
+        if args.matrix:
+            guncon.reset_matrix()
+        calibration = Calibration(screen_targets(width, height), args.samples, args.burst_time / 1000.0)
+        selector.register(guncon, selectors.EVENT_READ, calibration)
+        log.info(f"{guncon.key}: shoot target ({calibration.target[0]}, {calibration.target[1]})")
+
+    while selector.get_map():
+        for key, _ in selector.select(0.05):
+            guncon, calibration = key.fileobj, key.data
+            for shot, buttons in guncon.update():
+                calibration.frame(shot)
+                for button, value in buttons:
+                    if button == ecodes.BTN_LEFT and value == 1 and not calibration.trigger(shot):
+                        log.warning(f"{guncon.key}: shot off-screen")
+
+        for key in list(selector.get_map().values()):
+            guncon, calibration = key.fileobj, key.data
+            calibration.tick(time.time())
+            if calibration.sampling or len(calibration.bursts) == burst_counts[guncon.key]:
+                continue
+            burst_counts[guncon.key] = len(calibration.bursts)
+
+            if not calibration.done:
+                log.info(f"{guncon.key}: shoot target ({calibration.target[0]}, {calibration.target[1]})")
+                continue
+
+            selector.unregister(guncon)
+            # record the ranges the samples were taken with, before the calibration changes them
+            record = guncon.record(calibration, width, height)
+            if args.matrix:
+                calibrated = guncon.calibrate_matrix(calibration.targets, calibration.bursts, width, height)
+            else:
+                calibrated = guncon.calibrate(calibration.targets, calibration.bursts, width, height)
+            if calibrated:
+                records.append(record)
+
+    return records
+
+
+def run_replay(args):
+    """Calibrate from capture files, in parallel, returns the store entries"""
+    records = read_captures(args.replay)
+    entries = {}
+    with ProcessPoolExecutor() as pool:
+        for record, result in zip(records, pool.map(solve_record, records, [args.matrix] * len(records))):
+            key, entry, rms = result
+            if entry is None:
+                log.error(f"{key}: failed to calibrate, the shots are on one line")
+                continue
+            log.info(f"{key}: {entry}" + (f" rms error={rms:.2f}px" if rms is not None else ""))
+            # the last calibration of a gun wins
+            entries[key] = entry
+    return list(entries.values())
+
+
 def main():
     def point_type(value):
         m = re.match(r"\(?(\d+)\s*,\s*(\d+)\)?", value)
@@ -153,7 +590,20 @@ def main():
     parser.add_argument("-r", "--resolution", default="320x240")
     parser.add_argument("--center-target", default=(160, 120), type=point_type)
     parser.add_argument("--topleft-target", default=(50, 50), type=point_type)
-    parser.add_argument("--capture", default=None)
+    parser.add_argument("--capture", default=None,
+                        help="append the samples of every calibration to this capture file")
+    parser.add_argument("--matrix", action="store_true",
+                        help="load the calibration into the driver as a screen mapping instead of min/max")
+    parser.add_argument("--samples", default=30, type=int,
+                        help="number of samples taken for each target, starting at the trigger pull")
+    parser.add_argument("--burst-time", default=250, type=int,
+                        help="longest time in ms samples are taken for after the trigger pull")
+    parser.add_argument("--headless", action="store_true",
+                        help="calibrate every connected gun at once without showing the targets")
+    parser.add_argument("--replay", nargs="+", metavar="CAPTURE",
+                        help="calibrate from capture files instead of the guns")
+    parser.add_argument("--store", default=None,
+                        help="write the calibrations as a modprobe.d options file, - prints the entries")
     args = parser.parse_args()
 
     logging.basicConfig(level=logging.INFO)
@@ -165,101 +615,37 @@ def main():
         parser.error("Invalid resolution, eg. 320x240")
         return
 
-    guncon2_dev = None
-    # find the first guncon2
-    for device in [evdev.InputDevice(path) for path in evdev.list_devices()]:
-        if device.name == "Namco GunCon 2":
-            guncon2_dev = device
-            break
+    if args.replay:
+        entries = run_replay(args)
+        if args.store:
+            write_store(args.store, entries)
+        return 0
 
-    if guncon2_dev is None:
+    if evdev is None:
+        parser.error("python-evdev is needed to calibrate the guns")
+    if not args.headless and pygame is None:
+        parser.error("pygame is needed for the interactive calibration, use --headless")
+
+    guncons = find_guncons()
+    if not guncons:
         sys.stderr.write("Failed to find any attached GunCon2 devices")
         return 1
 
-    with guncon2_dev.grab_context():
-
-        guncon = Guncon2(guncon2_dev)
-
-        pygame.init()
-        pygame.font.init()
-        font = pygame.font.Font(None, 20)
-
-        start_text = font.render("Pull the TRIGGER to start calibration", True, WHITE)
-        start_text_w = start_text.get_rect()[2] // 2
-
-        pygame.display.set_caption("GunCon 2 two-point calibration")
-
-        screen = pygame.display.set_mode((width, height), pygame.FULLSCREEN)
-        clock = pygame.time.Clock()
-
-        state = STATE_START
-        running = True
-        targets = [(50, 50), (320 - 50, 50), (320 - 50, 240 - 50), (50, 240 - 50)]
-        target_shots = [(0, 0), (0, 0), (0, 0), (0, 0)]
-
-        cursor = draw_cursor(color=(255, 255, 0))
-        target = draw_target()
-        onscreen_warning = 0
-
-        while running:
-            for event in pygame.event.get():
-                if event.type == pygame.QUIT or (event.type == pygame.KEYDOWN and event.key == pygame.K_q):
-                    running = False
-
-            screen.fill((80, 80, 80))
-
-            raw_x, raw_y = guncon.pos
-            cx, cy = int(guncon.pos_normalised.x * width), int(guncon.pos_normalised.y * height)
-            trigger = False
-            for button, value in guncon.update():
-                if button == ecodes.BTN_LEFT and value == 1:
-                    trigger = True
-
-            raw_pos_txt = font.render(f"({raw_x}, {raw_y})", True, (128, 128, 255))
-            cal_pos_txt = font.render(f"({cx}, {cy})", True, (128, 128, 255))
-
-            screen.blit(raw_pos_txt, (20, height - 40))
-            blit_right(screen, cal_pos_txt, (width - 20, height - 40))
-
-            if state == STATE_START:
-                screen.blit(start_text, ((width // 2) - start_text_w, height - 60))
-                if width > cx >= 0 and height > cy >= 0:  # on screen
-                    screen.blit(cursor, (cx, cy))
-                if trigger:
-                    state = STATE_TARGET
-                    target_i = 0
-                    log.info("Set target at: ({}, {})".format(*targets[target_i]))
-
-            elif state == STATE_TARGET:
-                blit_center(screen, target, targets[target_i])
-                if raw_x > 5 and trigger:
-                    target_shots[target_i] = (raw_x, raw_y)
-                    target_i += 1
-                    if target_i == len(targets):
-                        state = STATE_DONE
-                    else:
-                        log.info("Set target at: ({}, {})".format(*targets[target_i]))
-
-            elif state == STATE_DONE:
-                guncon.calibrate(targets, target_shots)
-                state = STATE_START
-
-            # only trigger off screen shot on target states
-            if raw_x < 5 and trigger and state != STATE_START:
-                onscreen_warning = time.time() + 1.0
-
-            if raw_x > 5 and trigger:
-                onscreen_warning = 0
-
-            if time.time() < onscreen_warning:
-                off_screen_txt = font.render("Warning: Shot Off-Screen", True, (255, 80, 80))
-                blit_center(screen, off_screen_txt, (width // 2, 60))
-
-            fps = font.render(str(round(clock.get_fps())), True, (128, 128, 255))
-            screen.blit(fps, (20, 20))
-
-            pygame.display.flip()
-            clock.tick(30)
+    with contextlib.ExitStack() as stack:
+        if args.headless:
+            for guncon in guncons:
+                stack.enter_context(guncon.device.grab_context())
+            records = run_headless(args, guncons, width, height)
+        else:
+            # calibrate the first gun
+            stack.enter_context(guncons[0].device.grab_context())
+            records = run_interactive(args, guncons[0], width, height)
+
+    if args.capture:
+        write_capture(args.capture, records)
+    if args.store:
+        entries = [solve_record(record, args.matrix)[1] for record in records]
+        write_store(args.store, [entry for entry in entries if entry is not None])
 
 
 if __name__ == "__main__":
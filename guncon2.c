@@ -6,190 +6,3012 @@
  * Based largely on the PXRC driver by Marcus Folkesson <marcus.folkesson@gmail.com>
  *
  */
+#include <linux/atomic.h>
 #include <linux/bitops.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
 #include <linux/input.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/pm_runtime.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/usb/input.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "guncon2.h"
+#include "guncon2_decode.h"
+
+#define CREATE_TRACE_POINTS
+#include "guncon2_trace.h"
 
 #define NAMCO_VENDOR_ID 0x0b9a
 #define GUNCON2_PRODUCT_ID 0x016a
 
-#define GUNCON2_DPAD_LEFT BIT(15)
-#define GUNCON2_DPAD_RIGHT BIT(13)
-#define GUNCON2_DPAD_UP BIT(12)
-#define GUNCON2_DPAD_DOWN BIT(14)
-#define GUNCON2_TRIGGER BIT(5)
-#define GUNCON2_BTN_A BIT(11)
-#define GUNCON2_BTN_B BIT(10)
-#define GUNCON2_BTN_C BIT(9)
-#define GUNCON2_BTN_START BIT(7)
-#define GUNCON2_BTN_SELECT BIT(6)
+// default calibration, can be updated with evdev-joystick
+#define X_MIN 175
+#define X_MAX 720
+#define Y_MIN 20
+#define Y_MAX 240
+
+// resubmission backoff after URB errors, in ms
+#define GUNCON2_BACKOFF_MIN_MS 2
+#define GUNCON2_BACKOFF_MAX_MS 1000
+
+// time the device gets to acknowledge a new sampling mode, in ms
+#define GUNCON2_MODE_TIMEOUT_MS 500
+
+// number of interrupt URBs kept in flight
+#define GUNCON2_MIN_URBS 1
+#define GUNCON2_MAX_URBS 8
+
+static unsigned int urb_count = 2;
+module_param(urb_count, uint, 0444);
+MODULE_PARM_DESC(urb_count, "Number of interrupt URBs kept in flight (1-8, default 2)");
+
+static unsigned int interval;
+module_param(interval, uint, 0644);
+MODULE_PARM_DESC(interval, "Polling interval in ms, 0 for the interval of the endpoint (default 0)");
+
+static bool early_start;
+module_param(early_start, bool, 0644);
+MODULE_PARM_DESC(early_start, "Start sampling before the input device is registered (default N)");
+
+static int autosuspend_delay = 5000;
+module_param(autosuspend_delay, int, 0644);
+MODULE_PARM_DESC(autosuspend_delay, "Idle time in ms before a gun is autosuspended, -1 to disable (default 5000)");
+
+static bool enable_ring;
+module_param_named(ring, enable_ring, bool, 0444);
+MODULE_PARM_DESC(ring, "Create a /dev/guncon2-N sample ring device for each gun");
+
+#define GUNCON2_RING_ENTRIES 512
+
+static bool enable_aggregate;
+module_param_named(aggregate, enable_aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate, "Create /dev/guncon2-aggregate with per-frame snapshots of all guns");
+
+static bool recoil;
+module_param(recoil, bool, 0444);
+MODULE_PARM_DESC(recoil, "Add a force feedback rumble effect driving a recoil solenoid (default N)");
+
+// number of recoil control URBs, more than this in flight are coalesced
+#define GUNCON2_RECOIL_URBS 2
+
+// time an in-flight recoil output gets to complete when the gun is stopped, in ms
+#define GUNCON2_RECOIL_DRAIN_MS 50
+
+static unsigned int refresh_rate = 50;
+
+static int guncon2_refresh_rate_set(const char *val, const struct kernel_param *kp) {
+    unsigned int rate;
+    int error;
+
+    error = kstrtouint(val, 10, &rate);
+    if (error)
+        return error;
+    if (rate != 50 && rate != 60)
+        return -EINVAL;
+
+    *(unsigned int *)kp->arg = rate;
+    return 0;
+}
+
+static const struct kernel_param_ops guncon2_refresh_rate_ops = {
+        .set = guncon2_refresh_rate_set,
+        .get = param_get_uint,
+};
+module_param_cb(refresh_rate, &guncon2_refresh_rate_ops, &refresh_rate, 0644);
+MODULE_PARM_DESC(refresh_rate, "Default display refresh rate for new devices (50 or 60 Hz)");
+
+static bool interlace;
+module_param(interlace, bool, 0644);
+MODULE_PARM_DESC(interlace, "Default to interlaced video timing for new devices");
+
+static short x_offset;
+module_param(x_offset, short, 0644);
+MODULE_PARM_DESC(x_offset, "Default X offset applied by the gun for new devices (default 0)");
+
+/* the mode report only has a signed byte for the Y offset */
+static signed char y_offset;
+
+static int guncon2_y_offset_set(const char *val, const struct kernel_param *kp) {
+    s8 offset;
+    int error;
+
+    error = kstrtos8(val, 10, &offset);
+    if (error)
+        return error;
+
+    *(signed char *)kp->arg = offset;
+    return 0;
+}
+
+static int guncon2_y_offset_get(char *buffer, const struct kernel_param *kp) {
+    return scnprintf(buffer, PAGE_SIZE, "%d\n", *(signed char *)kp->arg);
+}
+
+static const struct kernel_param_ops guncon2_y_offset_ops = {
+        .set = guncon2_y_offset_set,
+        .get = guncon2_y_offset_get,
+};
+module_param_cb(y_offset, &guncon2_y_offset_ops, &y_offset, 0644);
+MODULE_PARM_DESC(y_offset, "Default Y offset applied by the gun for new devices (-128-127, default 0)");
+
+/* mode flags sent in the last byte of the mode report */
+#define GUNCON2_MODE_50HZ BIT(0)
+#define GUNCON2_MODE_INTERLACE BIT(1)
+
+/* longest coalescing window, in microseconds */
+#define GUNCON2_COALESCE_MAX_US 100000
+
+/* time around a trigger pull searched for an on-screen position, in microseconds */
+#define GUNCON2_SHOT_WINDOW_US 8000
+#define GUNCON2_SHOT_WINDOW_MAX_US 100000
+
+/* longest prediction look-ahead, in microseconds */
+#define GUNCON2_PREDICT_MAX_US 50000
+
+/*
+ * Aim quality limits in raw units: the largest change between two samples
+ * of a gun that is held still, and the smallest that can't be the gun
+ * moving (a sweep across the screen in a few samples).
+ */
+#define GUNCON2_QUALITY_STILL 4
+#define GUNCON2_QUALITY_JUMP 128
+
+/* the still deltas are averaged over about 2^6 samples and the ratios over about 2^10 */
+#define GUNCON2_QUALITY_MEAN_SHIFT 6
+#define GUNCON2_QUALITY_RATIO_SHIFT 10
+
+/* log2 histogram buckets, bucket n counts values in [2^(n-1), 2^n) */
+#define GUNCON2_HIST_BUCKETS 24
+
+/*
+ * Completion handler statistics, exposed in debugfs. The counters are atomic
+ * so they can be read at any time without taking a lock in the hot path.
+ */
+struct guncon2_stats {
+    atomic_long_t completions;
+    atomic_long_t status_ok;
+    atomic_long_t status_etime;
+    atomic_long_t status_econnreset;
+    atomic_long_t status_enoent;
+    atomic_long_t status_eshutdown;
+    atomic_long_t status_epipe;
+    atomic_long_t status_other;
+    atomic_long_t short_reads;
+    atomic_long_t resubmit_failures;
+    atomic_long_t backoffs;
+    atomic_long_t mode_errors;
+    atomic_long_t recoil_errors;
+    atomic_long_t packets_per_sec;
+    atomic_long_t interval_hist[GUNCON2_HIST_BUCKETS]; // microseconds between completions
+    atomic_long_t process_hist[GUNCON2_HIST_BUCKETS];  // nanoseconds from completion to input_sync
+
+    /* only touched by the completion handler */
+    ktime_t last_completion;
+    ktime_t window_start;
+    unsigned long window_packets;
+};
+
+static struct dentry *guncon2_debugfs_root;
+
+/*
+ * mmap'able sample ring behind /dev/guncon2-N. It is reference counted
+ * separately so an open file can outlive the device, guncon2 is cleared
+ * (under lock) when the device goes away.
+ */
+struct guncon2_ring {
+    struct kref kref;
+    struct miscdevice misc;
+    char name[16];
+    int id;
+
+    struct guncon2_ring_header *hdr;
+    struct guncon2_sample *entries;
+    size_t size;
+    u32 head; // the driver's copy, the one in the header is writable by userspace
+    u32 dropped;
+    wait_queue_head_t wait;
+
+    struct mutex lock;
+    struct guncon2 *guncon2; // protected by lock
+    bool busy; // protected by lock, samples are only pushed while it is set
+    bool registered;
+};
+
+static DEFINE_IDA(guncon2_ring_ida);
+
+/*
+ * Aggregate device, the registry of guns is protected by the mutex and the
+ * frame being built by the spinlock, which is taken from the completion
+ * handlers of all guns.
+ */
+static struct guncon2_aggregate {
+    struct mutex mutex;
+    struct guncon2 *guns[GUNCON2_AGG_MAX_GUNS];
+    unsigned int readers;
+
+    spinlock_t lock;
+    unsigned long connected; // slots with a gun
+    unsigned long updated;   // slots reported in the frame being built
+    bool building;
+    struct guncon2_frame current_frame;
+    struct guncon2_frame published;
+    wait_queue_head_t wait;
+} guncon2_agg = {
+        .mutex = __MUTEX_INITIALIZER(guncon2_agg.mutex),
+        .lock = __SPIN_LOCK_UNLOCKED(guncon2_agg.lock),
+        .wait = __WAIT_QUEUE_HEAD_INITIALIZER(guncon2_agg.wait),
+};
+
+/* 6-byte SET_REPORT payload that configures the sampling mode */
+struct gc_mode {
+    __le16 x_offset;
+    signed char y_offset;
+    unsigned char reserved[2];
+    unsigned char mode;
+} __packed;
+
+struct guncon2_mode_msg {
+    struct usb_ctrlrequest req;
+    struct gc_mode mode;
+};
+
+/* SET_REPORT(output, report 1) with the recoil strength, 0 is off */
+struct guncon2_recoil_msg {
+    struct usb_ctrlrequest req;
+    u8 strength;
+};
+
+/*
+ * Settings read by the completion handler. A change publishes a new copy
+ * with RCU, so the completion handler never waits for a writer and readers
+ * in sysfs never hold it up. Writers are serialised by params_lock.
+ */
+struct guncon2_params {
+    struct rcu_head rcu;
+
+    /* raw to screen-space mapping */
+    bool cal_enabled;
+    s32 cal_matrix[6]; // Q16 fixed point, x' = m0*x + m1*y + m2, y' = m3*x + m4*y + m5
+    u16 cal_width;
+    u16 cal_height;
+
+    /* jitter filter */
+    bool filter_enabled;
+    u32 filter_min_cutoff;
+    u32 filter_beta;
+
+    /* coalescing */
+    u32 coalesce_us;
+    u32 coalesce_samples;
+
+    /* shot latch */
+    u32 shot_window_us;
+
+    /* prediction look-ahead in microseconds, 0 is off */
+    u32 predict_us;
+};
+
+/*
+ * Rolling aim quality statistics. The means and variances are of the change
+ * in raw position between two on-screen samples while the gun is held still,
+ * in Q16 raw units (and raw units squared). The ratios are Q16 fractions of
+ * all samples (offscreen) and of the on-screen samples (jumps).
+ */
+struct guncon2_quality {
+    u64 samples;
+    u64 offscreen;
+    u64 jumps;
+    s64 mean[2];
+    s64 var[2];
+    s32 offscreen_ratio;
+    s32 jump_ratio;
+};
+
+/* State of the gun as it is sent to the input core */
+struct guncon2_state {
+    ktime_t timestamp;
+    u32 msc_timestamp;
+    unsigned short x, y;
+    u16 buttons;
+    s8 hat_x, hat_y;
+    bool offscreen;
+    bool has_position; // x/y are valid, not set while off-screen before the first on-screen sample
+    bool shot; // a shot was latched, at shot_x/shot_y
+    unsigned short shot_x, shot_y;
+};
+
+struct guncon2 {
+    struct input_dev *input_device;
+    struct usb_interface *intf;
+    const struct guncon2_model *model;
+    struct urb *urbs[GUNCON2_MAX_URBS];
+    unsigned int num_urbs;
+    size_t xfer_size;
+    unsigned int interval_us; // polling interval the host settled on, 0 until first submitted
+    struct usb_anchor submitted;
+    struct mutex pm_mutex;
+
+    /*
+     * URBs that completed with an error are parked on the deferred anchor
+     * and resubmitted from delayed work, with a delay that doubles for each
+     * error in a row. running is cleared before the URBs are killed, so
+     * nothing is parked or resubmitted after that.
+     */
+    struct usb_anchor deferred;
+    struct delayed_work resubmit_work;
+    unsigned int backoff_ms; // only touched by the completion handler
+    bool running;
+
+    unsigned int users; // evdev and ring users, protected by pm_mutex
+    bool early_user; // probe started the gun, handed to the first evdev open
+    bool is_open;
+    struct gc_mode mode; // protected by pm_mutex
+
+    /*
+     * The sampling mode is sent with an asynchronous SET_REPORT, so opening
+     * the gun never waits on the control endpoint. A mode set while the
+     * previous one is still in flight is kept in mode_next and sent when it
+     * completes. Everything here is protected by mode_lock.
+     */
+    struct urb *mode_urb;
+    struct guncon2_mode_msg *mode_msg; // DMA buffer for mode_urb
+    struct delayed_work mode_timeout;
+    spinlock_t mode_lock;
+    struct gc_mode mode_next;
+    unsigned long mode_deadline;
+    bool mode_busy;
+    bool mode_pending;
+    bool mode_timed_out;
+
+    /*
+     * Recoil output, played from the force feedback timer so it must never
+     * sleep. The control URBs are allocated up front and a strength is sent
+     * on any idle one; while all of them are in flight only the latest
+     * strength is kept, and sent when one completes. Every URB in flight
+     * holds a runtime PM reference. A strength played while the gun is
+     * suspended is kept as well, with a reference that wakes the gun up,
+     * and sent on resume. Protected by recoil_lock.
+     */
+    struct urb *recoil_urbs[GUNCON2_RECOIL_URBS];
+    struct guncon2_recoil_msg *recoil_msgs; // DMA buffers for recoil_urbs
+    struct usb_anchor recoil_submitted;
+    spinlock_t recoil_lock;
+    unsigned long recoil_idle; // bitmap of the idle recoil URBs
+    u8 recoil_next;
+    u8 recoil_sent; // last strength submitted
+    bool recoil_pending;
+    bool recoil_suspended; // between suspend and resume, nothing can be submitted
+    bool recoil_wake; // holds the reference taken to resume for recoil_next
+
+    char phys[64];
+    char cal_key[64]; // key of the calibration store entry for this gun
+    struct list_head cal_node; // on guncon2_gun_list, protected by guncon2_cal_mutex
+
+    /*
+     * Position of the last valid sample. Only touched by the completion
+     * handler, which the USB core never runs concurrently for one endpoint.
+     * have_last is set by the first report after a start, have_position by
+     * the first on-screen one.
+     */
+    bool have_last;
+    bool have_position;
+    u16 last_x;
+    u16 last_y;
+
+    /*
+     * Shot latch, also only touched by the completion handler. A trigger
+     * pull while off-screen waits until shot_deadline for an on-screen
+     * sample, and falls back to the last on-screen sample before the pull
+     * (shot_back) if that is nearer.
+     */
+    u16 last_buttons;
+    bool have_valid;
+    struct guncon2_sample last_valid;
+    bool shot_pending;
+    bool shot_have_back;
+    ktime_t shot_deadline;
+    struct guncon2_sample shot_back;
+
+    /*
+     * Last state sent to the input core, and the state held back while
+     * coalescing. Protected by report_lock, the flush timer reports too.
+     */
+    spinlock_t report_lock;
+    bool have_reported;
+    struct guncon2_state reported;
+    bool have_pending;
+    struct guncon2_state pending;
+    unsigned int pending_samples;
+    struct hrtimer coalesce_timer;
+
+    /*
+     * Latest decoded sample, for current_state. The completion handler is
+     * the only writer, readers retry instead of taking a lock.
+     */
+    seqcount_t latest_seq;
+    struct guncon2_sample latest;
+
+    /*
+     * Aim quality, also written by the completion handler only and read
+     * under quality_seq. quality_last is the previous raw position, valid
+     * while quality_have_last is set.
+     */
+    seqcount_t quality_seq;
+    struct guncon2_quality quality;
+    bool quality_have_last;
+    u16 quality_last[2];
+
+    /* MSC_TIMESTAMP bookkeeping, in USB frames (1ms) */
+    int last_frame;
+    ktime_t last_report;
+    u32 msc_timestamp;
+
+    struct guncon2_params __rcu *params;
+    struct mutex params_lock;
+    int raw_min[2], raw_max[2]; // ABS_X/ABS_Y ranges before the mapping was enabled, protected by pm_mutex
+
+    /* jitter filter and predictor state, only touched by the completion handler */
+    struct guncon2_filter filter;
+    ktime_t filter_last;
+    struct guncon2_predictor predictor;
+    ktime_t predict_last;
+
+    struct guncon2_stats stats;
+
+    /*
+     * Hotplug timing in ns since the start of probe, each is written once
+     * and 0 until then. The report times are written by the completion
+     * handler, registered tells it the input device is registered.
+     */
+    ktime_t probe_time;
+    s64 registered_ns;
+    s64 first_report_ns; // first valid report from the gun
+    s64 first_event_ns;  // first report once the input device is registered
+    bool registered;
+
+    struct dentry *debugfs_dir;
+    struct guncon2_ring *ring;
+    int agg_slot; // slot in the aggregate device, -1 if none
+    bool agg_user; // the aggregate device holds a user, protected by the aggregate mutex
+};
+
+/*
+ * Host controllers wrap the frame counter at different widths, but all of
+ * them at a multiple of 1024 frames.
+ */
+#define GUNCON2_FRAME_MASK 0x3ff
+
+/* Read one setting, for sysfs */
+#define guncon2_param(guncon2, field)                              \
+    ({                                                             \
+        typeof(((struct guncon2_params *)0)->field) __value;       \
+                                                                   \
+        rcu_read_lock();                                           \
+        __value = rcu_dereference((guncon2)->params)->field;       \
+        rcu_read_unlock();                                         \
+        __value;                                                   \
+    })
+
+/*
+ * Start changing the settings, returns a copy of the current ones to be
+ * changed and published with guncon2_params_commit(), or NULL if there is
+ * no memory for it.
+ */
+static struct guncon2_params *guncon2_params_begin(struct guncon2 *guncon2) {
+    struct guncon2_params *params;
+
+    mutex_lock(&guncon2->params_lock);
+    params = kmemdup(rcu_dereference_protected(guncon2->params, lockdep_is_held(&guncon2->params_lock)),
+                     sizeof(*params), GFP_KERNEL);
+    if (!params)
+        mutex_unlock(&guncon2->params_lock);
+
+    return params;
+}
+
+static void guncon2_params_commit(struct guncon2 *guncon2, struct guncon2_params *params) {
+    struct guncon2_params *old;
+
+    old = rcu_replace_pointer(guncon2->params, params, lockdep_is_held(&guncon2->params_lock));
+    mutex_unlock(&guncon2->params_lock);
+
+    kfree_rcu(old, rcu);
+}
+
+/* Change one setting, for sysfs */
+#define guncon2_param_set(guncon2, field, value)                            \
+    ({                                                                      \
+        struct guncon2_params *__params = guncon2_params_begin(guncon2);    \
+                                                                            \
+        if (__params) {                                                     \
+            __params->field = (value);                                      \
+            guncon2_params_commit(guncon2, __params);                       \
+        }                                                                   \
+        __params ? 0 : -ENOMEM;                                             \
+    })
+
+static void guncon2_free_params(void *data) {
+    struct guncon2 *guncon2 = data;
+
+    /* the URBs, the timer and sysfs are gone, nothing can read them */
+    kfree(rcu_dereference_protected(guncon2->params, true));
+}
+
+static void guncon2_filter_position(struct guncon2 *guncon2, const struct guncon2_params *params, ktime_t now,
+                                    unsigned short *x, unsigned short *y) {
+    if (!params->filter_enabled) {
+        guncon2->filter.primed = false;
+        return;
+    }
+
+    guncon2_filter_apply(&guncon2->filter, ktime_us_delta(now, guncon2->filter_last),
+                         params->filter_min_cutoff, params->filter_beta, x, y);
+    guncon2->filter_last = now;
+}
+
+/* Record the time from probe to the first report that can reach userspace */
+static void guncon2_note_first_event(struct guncon2 *guncon2, struct urb *urb, ktime_t now) {
+    s64 event_ns = ktime_to_ns(ktime_sub(now, guncon2->probe_time));
+
+    WRITE_ONCE(guncon2->first_event_ns, event_ns);
+    trace_guncon2_first_event(urb, div_s64(guncon2->first_report_ns, NSEC_PER_USEC),
+                              div_s64(event_ns, NSEC_PER_USEC));
+}
+
+static void guncon2_reset_timestamp(struct guncon2 *guncon2, struct urb *urb, ktime_t now) {
+    guncon2->last_frame = usb_get_current_frame_number(urb->dev);
+    guncon2->last_report = now;
+}
+
+/*
+ * Advance the MSC_TIMESTAMP counter to the current USB frame. The frame
+ * counter is only unambiguous for gaps shorter than its wrap, longer gaps
+ * fall back to the completion timestamps.
+ */
+static void guncon2_update_timestamp(struct guncon2 *guncon2, struct urb *urb, ktime_t now) {
+    int frame = usb_get_current_frame_number(urb->dev);
+    s64 elapsed = ktime_us_delta(now, guncon2->last_report);
+
+    if (frame >= 0 && elapsed < (GUNCON2_FRAME_MASK + 1) * USEC_PER_MSEC / 2)
+        guncon2->msc_timestamp += ((frame - guncon2->last_frame) & GUNCON2_FRAME_MASK) * USEC_PER_MSEC;
+    else
+        guncon2->msc_timestamp += elapsed;
+
+    guncon2->last_frame = frame;
+    guncon2->last_report = now;
+}
+
+/* Extrapolate the reported position, it is passed through while prediction is off */
+static void guncon2_predict_position(struct guncon2 *guncon2, const struct guncon2_params *params, ktime_t now,
+                                     unsigned short x, unsigned short y, unsigned short *px, unsigned short *py) {
+    if (!params->predict_us) {
+        guncon2->predictor.primed = false;
+        *px = x;
+        *py = y;
+        return;
+    }
+
+    guncon2_predict_apply(&guncon2->predictor, ktime_us_delta(now, guncon2->predict_last), params->predict_us,
+                          x, y, px, py);
+    guncon2->predict_last = now;
+
+    /* keep it on the screen the mapping was loaded for */
+    if (params->cal_enabled) {
+        *px = min_t(unsigned short, *px, params->cal_width - 1);
+        *py = min_t(unsigned short, *py, params->cal_height - 1);
+    }
+}
+
+/*
+ * Apply the affine calibration to a raw sample, the result is clamped to the
+ * screen size the matrix was loaded with.
+ */
+static void guncon2_map_position(const struct guncon2_params *params, unsigned short *x, unsigned short *y) {
+    if (params->cal_enabled)
+        guncon2_map_apply(params->cal_matrix, params->cal_width, params->cal_height, x, y);
+}
+
+/* Add a sample to the aim quality statistics, O(1), called from the completion handler only */
+static void guncon2_quality_update(struct guncon2 *guncon2, unsigned short x, unsigned short y, bool offscreen) {
+    struct guncon2_quality *q = &guncon2->quality;
+    const s32 one = BIT(GUNCON2_Q16_SHIFT);
+    bool moved = !offscreen && guncon2->quality_have_last;
+    bool still = false, jump = false;
+    int d[2] = {};
+    unsigned int i;
+    s64 diff, incr;
+
+    if (moved) {
+        d[0] = x - guncon2->quality_last[0];
+        d[1] = y - guncon2->quality_last[1];
+        still = abs(d[0]) <= GUNCON2_QUALITY_STILL && abs(d[1]) <= GUNCON2_QUALITY_STILL;
+        jump = abs(d[0]) >= GUNCON2_QUALITY_JUMP || abs(d[1]) >= GUNCON2_QUALITY_JUMP;
+    }
+
+    preempt_disable();
+    write_seqcount_begin(&guncon2->quality_seq);
+
+    q->samples++;
+    q->offscreen += offscreen;
+    q->offscreen_ratio += ((offscreen ? one : 0) - q->offscreen_ratio) >> GUNCON2_QUALITY_RATIO_SHIFT;
+
+    if (moved) {
+        q->jumps += jump;
+        q->jump_ratio += ((jump ? one : 0) - q->jump_ratio) >> GUNCON2_QUALITY_RATIO_SHIFT;
+    }
+
+    /* exponentially weighted mean and variance */
+    for (i = 0; still && i < 2; i++) {
+        diff = ((s64) d[i] << GUNCON2_Q16_SHIFT) - q->mean[i];
+        incr = diff >> GUNCON2_QUALITY_MEAN_SHIFT;
+        q->mean[i] += incr;
+        q->var[i] += (diff * incr) >> GUNCON2_Q16_SHIFT;
+        q->var[i] -= q->var[i] >> GUNCON2_QUALITY_MEAN_SHIFT;
+    }
+
+    write_seqcount_end(&guncon2->quality_seq);
+    preempt_enable();
+
+    guncon2->quality_have_last = !offscreen;
+    guncon2->quality_last[0] = x;
+    guncon2->quality_last[1] = y;
+}
+
+/* Publish the latest sample for current_state, called from the completion handler only */
+static void guncon2_publish_latest(struct guncon2 *guncon2, const struct guncon2_sample *sample) {
+    /* a writer preempted inside the section would leave the readers spinning */
+    preempt_disable();
+    write_seqcount_begin(&guncon2->latest_seq);
+    guncon2->latest = *sample;
+    write_seqcount_end(&guncon2->latest_seq);
+    preempt_enable();
+}
+
+/* Publish a sample to the ring, called from the completion handler only */
+static void guncon2_ring_push(struct guncon2_ring *ring, const struct guncon2_sample *sample) {
+    u32 tail;
+
+    /* nobody would read them, and the next consumer would start with stale samples */
+    if (!READ_ONCE(ring->busy))
+        return;
+
+    tail = smp_load_acquire(&ring->hdr->tail);
+    if (ring->head - tail >= GUNCON2_RING_ENTRIES) {
+        WRITE_ONCE(ring->hdr->dropped, ++ring->dropped);
+        return;
+    }
+
+    ring->entries[ring->head & (GUNCON2_RING_ENTRIES - 1)] = *sample;
+    smp_store_release(&ring->hdr->head, ++ring->head);
+
+    if (wq_has_sleeper(&ring->wait))
+        wake_up_interruptible_poll(&ring->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* Publish the frame being built, must be called with the aggregate lock held */
+static void guncon2_agg_publish(void) {
+    guncon2_agg.current_frame.sequence = guncon2_agg.published.sequence + 1;
+    guncon2_agg.published = guncon2_agg.current_frame;
+    guncon2_agg.building = false;
+
+    if (wq_has_sleeper(&guncon2_agg.wait))
+        wake_up_interruptible_poll(&guncon2_agg.wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static void guncon2_agg_update(struct guncon2 *guncon2, int frame, const struct guncon2_sample *sample) {
+    struct guncon2_gun_state *gun;
+    unsigned long flags;
+    unsigned int i;
+    int slot;
+
+    spin_lock_irqsave(&guncon2_agg.lock, flags);
+    slot = guncon2->agg_slot;
+    if (slot < 0)
+        goto out;
+
+    /* a gun reporting in a later frame closes the current one */
+    if (guncon2_agg.building && (u32) frame != guncon2_agg.current_frame.frame)
+        guncon2_agg_publish();
+
+    if (!guncon2_agg.building) {
+        guncon2_agg.building = true;
+        guncon2_agg.updated = 0;
+        guncon2_agg.current_frame.frame = frame;
+        for (i = 0; i < GUNCON2_AGG_MAX_GUNS; i++)
+            guncon2_agg.current_frame.guns[i].flags &= ~GUNCON2_GUN_UPDATED;
+    }
+
+    gun = &guncon2_agg.current_frame.guns[slot];
+    gun->x = sample->x;
+    gun->y = sample->y;
+    gun->buttons = sample->buttons;
+    gun->flags = sample->flags | GUNCON2_GUN_CONNECTED | GUNCON2_GUN_UPDATED;
+    guncon2_agg.current_frame.timestamp = sample->timestamp;
+    __set_bit(slot, &guncon2_agg.updated);
+
+    if ((guncon2_agg.updated & guncon2_agg.connected) == guncon2_agg.connected)
+        guncon2_agg_publish();
+
+out:
+    spin_unlock_irqrestore(&guncon2_agg.lock, flags);
+}
+
+/* Park an URB that completed with an error and resubmit it after a backoff */
+static void guncon2_defer_resubmit(struct guncon2 *guncon2, struct urb *urb) {
+    if (!READ_ONCE(guncon2->running))
+        return;
+
+    /* the URBs of one burst of errors share a resubmit, double once per burst */
+    if (!delayed_work_pending(&guncon2->resubmit_work))
+        guncon2->backoff_ms = clamp_t(unsigned int, guncon2->backoff_ms * 2,
+                                      GUNCON2_BACKOFF_MIN_MS, GUNCON2_BACKOFF_MAX_MS);
+
+    atomic_long_inc(&guncon2->stats.backoffs);
+    trace_guncon2_backoff(urb, urb->status, guncon2->backoff_ms);
+
+    usb_anchor_urb(urb, &guncon2->deferred);
+    schedule_delayed_work(&guncon2->resubmit_work, msecs_to_jiffies(guncon2->backoff_ms));
+}
+
+static void guncon2_hist_add(atomic_long_t *hist, u64 value) {
+    atomic_long_inc(&hist[min_t(unsigned int, fls64(value), GUNCON2_HIST_BUCKETS - 1)]);
+}
+
+/* Count a completion and keep the inter-arrival histogram and packet rate */
+static void guncon2_stats_completion(struct guncon2_stats *stats, int status, ktime_t now) {
+    atomic_long_inc(&stats->completions);
+
+    switch (status) {
+        case 0:
+            atomic_long_inc(&stats->status_ok);
+            break;
+        case -ETIME:
+            atomic_long_inc(&stats->status_etime);
+            break;
+        case -ECONNRESET:
+            atomic_long_inc(&stats->status_econnreset);
+            break;
+        case -ENOENT:
+            atomic_long_inc(&stats->status_enoent);
+            break;
+        case -ESHUTDOWN:
+            atomic_long_inc(&stats->status_eshutdown);
+            break;
+        case -EPIPE:
+            atomic_long_inc(&stats->status_epipe);
+            break;
+        default:
+            atomic_long_inc(&stats->status_other);
+            break;
+    }
+
+    if (stats->last_completion)
+        guncon2_hist_add(stats->interval_hist, ktime_us_delta(now, stats->last_completion));
+    stats->last_completion = now;
+
+    stats->window_packets++;
+    if (ktime_us_delta(now, stats->window_start) >= USEC_PER_SEC) {
+        atomic_long_set(&stats->packets_per_sec, stats->window_packets);
+        stats->window_packets = 0;
+        stats->window_start = now;
+    }
+}
+
+/* Send a state to the input core, only what changed since the last one. Called with the report_lock held. */
+static void guncon2_emit_state(struct guncon2 *guncon2, const struct guncon2_state *state) {
+    struct input_dev *input = guncon2->input_device;
+    const struct guncon2_state *last = &guncon2->reported;
+    bool full = !guncon2->have_reported;
+    bool full_position = full || !last->has_position;
+    u16 buttons = state->buttons;
+    u16 changed = full ? 0xffff : buttons ^ last->buttons;
+
+    /* stamp the events with the time the URB completed */
+    input_set_timestamp(input, state->timestamp);
+    input_event(input, EV_MSC, MSC_TIMESTAMP, state->msc_timestamp);
+    if (state->shot)
+        input_event(input, EV_MSC, MSC_RAW, (u32) state->shot_x << 16 | state->shot_y);
+
+    /* Aiming, there is nothing to report before the gun has seen the screen */
+    if (state->has_position && (full_position || state->x != last->x))
+        input_report_abs(input, ABS_X, state->x);
+    if (state->has_position && (full_position || state->y != last->y))
+        input_report_abs(input, ABS_Y, state->y);
+    if (full || state->offscreen != last->offscreen)
+        input_report_abs(input, ABS_DISTANCE, state->offscreen);
+
+    // d-pad
+    if (changed & GUNCON2_DPAD_X)
+        input_report_abs(input, ABS_HAT0X, state->hat_x);
+    if (changed & GUNCON2_DPAD_Y)
+        input_report_abs(input, ABS_HAT0Y, state->hat_y);
+
+    // main buttons
+    if (changed & GUNCON2_TRIGGER)
+        input_report_key(input, BTN_LEFT, buttons & GUNCON2_TRIGGER);
+    if (changed & (GUNCON2_BTN_A | GUNCON2_BTN_C))
+        input_report_key(input, BTN_RIGHT, buttons & GUNCON2_BTN_A || buttons & GUNCON2_BTN_C);
+    if (changed & GUNCON2_BTN_B) {
+        input_report_key(input, BTN_MIDDLE, buttons & GUNCON2_BTN_B);
+        input_report_key(input, BTN_B, buttons & GUNCON2_BTN_B);
+    }
+    if (changed & GUNCON2_BTN_A)
+        input_report_key(input, BTN_A, buttons & GUNCON2_BTN_A);
+    if (changed & GUNCON2_BTN_C)
+        input_report_key(input, BTN_C, buttons & GUNCON2_BTN_C);
+    if (changed & GUNCON2_BTN_START)
+        input_report_key(input, BTN_START, buttons & GUNCON2_BTN_START);
+    if (changed & GUNCON2_BTN_SELECT)
+        input_report_key(input, BTN_SELECT, buttons & GUNCON2_BTN_SELECT);
+
+    input_sync(input);
+
+    guncon2->reported = *state;
+    guncon2->have_reported = true;
+}
+
+/*
+ * Report a new state, identical states are dropped. With coalescing enabled
+ * a change of position alone is held back until the window expires or
+ * coalesce_samples samples have come in, and only the latest position is
+ * sent. Button changes are sent straight away, together with the latest
+ * position. Returns true if the state was sent.
+ */
+static bool guncon2_report_state(struct guncon2 *guncon2, const struct guncon2_params *params,
+                                 const struct guncon2_state *state) {
+    const struct guncon2_state *last = &guncon2->reported;
+    u32 window = params->coalesce_us;
+    u32 samples = params->coalesce_samples;
+    unsigned long flags;
+    bool sent = false;
+
+    spin_lock_irqsave(&guncon2->report_lock, flags);
+    if (guncon2->have_reported && !state->shot && state->buttons == last->buttons && state->x == last->x &&
+        state->y == last->y && state->offscreen == last->offscreen && state->has_position == last->has_position) {
+        /* back to what was last sent, anything held back is stale */
+        guncon2->have_pending = false;
+        goto out;
+    }
+
+    if (window && guncon2->have_reported && !state->shot && state->buttons == last->buttons) {
+        if (!guncon2->have_pending) {
+            guncon2->pending_samples = 0;
+            hrtimer_start(&guncon2->coalesce_timer, us_to_ktime(window), HRTIMER_MODE_REL);
+        }
+        guncon2->pending = *state;
+        guncon2->have_pending = true;
+        if (!samples || ++guncon2->pending_samples < samples)
+            goto out;
+    }
+
+    guncon2->have_pending = false;
+    guncon2_emit_state(guncon2, state);
+    sent = true;
+
+out:
+    spin_unlock_irqrestore(&guncon2->report_lock, flags);
+    return sent;
+}
+
+/* End of a coalescing window, send the state that was held back */
+static enum hrtimer_restart guncon2_coalesce_expired(struct hrtimer *timer) {
+    struct guncon2 *guncon2 = container_of(timer, struct guncon2, coalesce_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&guncon2->report_lock, flags);
+    if (guncon2->have_pending) {
+        guncon2->have_pending = false;
+        guncon2_emit_state(guncon2, &guncon2->pending);
+    }
+    spin_unlock_irqrestore(&guncon2->report_lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Registered right after the input device is allocated, so it runs before
+ * the input device is freed even while an open ring keeps the URBs from
+ * being killed until the ring is torn down.
+ */
+static void guncon2_coalesce_stop(void *context) {
+    struct guncon2 *guncon2 = context;
+
+    hrtimer_cancel(&guncon2->coalesce_timer);
+    guncon2->have_pending = false;
+}
+
+/*
+ * Latch the position of a shot from the sample stream. A trigger pull takes
+ * the position of its own sample when that is on-screen, otherwise the
+ * nearest on-screen sample within shot_window_us either side of the pull.
+ * Returns true with the latched sample in shot once a shot is resolved, a
+ * shot without an on-screen sample in the window is flagged off-screen.
+ */
+static bool guncon2_latch_shot(struct guncon2 *guncon2, const struct guncon2_params *params,
+                               const struct guncon2_sample *sample, struct guncon2_sample *shot) {
+    bool valid = !(sample->flags & GUNCON2_SAMPLE_OFFSCREEN);
+    bool edge = sample->buttons & ~guncon2->last_buttons & GUNCON2_TRIGGER;
+    ktime_t now = ns_to_ktime(sample->timestamp);
+    s64 window = (s64) params->shot_window_us * NSEC_PER_USEC;
+    bool resolved = false;
+
+    guncon2->last_buttons = sample->buttons;
+
+    /* a new pull replaces one that is still waiting, they can't be 1ms apart */
+    if (guncon2->shot_pending && !edge) {
+        if (valid && ktime_compare(now, guncon2->shot_deadline) <= 0) {
+            /* nearer to the pull than the sample before it */
+            *shot = *sample;
+            resolved = true;
+        } else if (ktime_compare(now, guncon2->shot_deadline) >= 0) {
+            if (guncon2->shot_have_back) {
+                *shot = guncon2->shot_back;
+            } else {
+                *shot = *sample;
+                shot->flags |= GUNCON2_SAMPLE_OFFSCREEN;
+            }
+            resolved = true;
+        }
+        guncon2->shot_pending = !resolved;
+    }
+
+    if (edge) {
+        if (valid) {
+            *shot = *sample;
+            resolved = true;
+            guncon2->shot_pending = false;
+        } else {
+            guncon2->shot_have_back = guncon2->have_valid &&
+                                      sample->timestamp - guncon2->last_valid.timestamp <= window;
+            if (guncon2->shot_have_back) {
+                /* wait no longer than the sample before the pull is away from it */
+                guncon2->shot_back = guncon2->last_valid;
+                window = sample->timestamp - guncon2->last_valid.timestamp;
+            }
+            guncon2->shot_deadline = ktime_add_ns(now, window);
+            guncon2->shot_pending = true;
+        }
+    }
+
+    if (valid) {
+        guncon2->last_valid = *sample;
+        guncon2->have_valid = true;
+    }
+
+    if (resolved)
+        shot->flags |= GUNCON2_SAMPLE_SHOT;
+
+    return resolved;
+}
+
+typedef bool (*guncon2_decode_t)(const unsigned char *data, unsigned int actual_length,
+                                 struct guncon2_report *report);
+
+/*
+ * Completion handler body, inlined into a handler per model so the decoder
+ * is a direct call with the layout of that model compiled in.
+ */
+static __always_inline void guncon2_usb_irq(struct urb *urb, guncon2_decode_t decode) {
+    ktime_t timestamp = ktime_get();
+    struct guncon2 *guncon2 = urb->context;
+    unsigned char *data = urb->transfer_buffer;
+    const struct guncon2_params *params;
+    struct guncon2_report report;
+    int error;
+    u16 buttons;
+    unsigned short x, y, raw_x, raw_y, predict_x, predict_y;
+    struct guncon2_sample sample, shot;
+    struct guncon2_state state;
+    bool offscreen, have_shot;
+
+    guncon2_stats_completion(&guncon2->stats, urb->status, timestamp);
+    if (trace_guncon2_urb_complete_enabled())
+        trace_guncon2_urb_complete(urb, usb_get_current_frame_number(urb->dev));
+
+    switch (urb->status) {
+        case 0:
+            /* success */
+            guncon2->backoff_ms = 0;
+            break;
+        case -ETIME:
+            /* this urb is timing out */
+            dev_dbg(&guncon2->intf->dev,
+                    "%s - urb timed out - was the device unplugged?\n",
+                    __func__);
+            return;
+        case -ECONNRESET:
+        case -ENOENT:
+        case -ESHUTDOWN:
+        case -EPIPE:
+            /* this urb is terminated, clean up */
+            dev_dbg(&guncon2->intf->dev, "%s - urb shutting down with status: %d\n",
+                    __func__, urb->status);
+            return;
+        default:
+            dev_dbg(&guncon2->intf->dev, "%s - nonzero urb status received: %d\n",
+                    __func__, urb->status);
+            guncon2_defer_resubmit(guncon2, urb);
+            return;
+    }
+
+    if (decode(data, urb->actual_length, &report)) {
+        raw_x = x = report.x;
+        raw_y = y = report.y;
+        buttons = report.buttons;
+        offscreen = report.offscreen;
+        trace_guncon2_report(urb, x, y, buttons);
+
+        rcu_read_lock();
+        params = rcu_dereference(guncon2->params);
+
+        /*
+         * Hold the last position while off-screen, the samples are garbage.
+         * Before the first on-screen sample there is no position to hold.
+         */
+        if (offscreen) {
+            x = guncon2->have_position ? guncon2->last_x : 0;
+            y = guncon2->have_position ? guncon2->last_y : 0;
+            guncon2->filter.primed = false;
+            guncon2->predictor.primed = false;
+            predict_x = x;
+            predict_y = y;
+        } else {
+            guncon2_filter_position(guncon2, params, timestamp, &x, &y);
+            guncon2_map_position(params, &x, &y);
+            guncon2_predict_position(guncon2, params, timestamp, x, y, &predict_x, &predict_y);
+        }
+
+        if (guncon2->have_last) {
+            guncon2_update_timestamp(guncon2, urb, timestamp);
+        } else {
+            guncon2_reset_timestamp(guncon2, urb, timestamp);
+            /* a trigger already held when the gun was started is not a pull */
+            guncon2->last_buttons = buttons;
+        }
+
+        sample = (struct guncon2_sample){
+                .timestamp = ktime_to_ns(timestamp),
+                .msc_timestamp = guncon2->msc_timestamp,
+                .x = x,
+                .y = y,
+                .raw_x = raw_x,
+                .raw_y = raw_y,
+                .buttons = buttons,
+                .flags = offscreen ? GUNCON2_SAMPLE_OFFSCREEN : 0,
+                .predict_x = predict_x,
+                .predict_y = predict_y,
+                .data_len = min_t(unsigned int, urb->actual_length, GUNCON2_SAMPLE_DATA_LEN),
+        };
+        memcpy(sample.data, data, sample.data_len);
+
+        if (unlikely(!guncon2->first_report_ns))
+            WRITE_ONCE(guncon2->first_report_ns, ktime_to_ns(ktime_sub(timestamp, guncon2->probe_time)));
+        if (unlikely(!guncon2->first_event_ns) && READ_ONCE(guncon2->registered))
+            guncon2_note_first_event(guncon2, urb, timestamp);
+
+        have_shot = guncon2_latch_shot(guncon2, params, &sample, &shot);
+
+        guncon2_publish_latest(guncon2, &sample);
+        guncon2_quality_update(guncon2, raw_x, raw_y, offscreen);
+        if (guncon2->ring) {
+            guncon2_ring_push(guncon2->ring, &sample);
+            if (have_shot)
+                guncon2_ring_push(guncon2->ring, &shot);
+        }
+        if (READ_ONCE(guncon2->agg_slot) >= 0)
+            guncon2_agg_update(guncon2, guncon2->last_frame, &sample);
+
+        state = (struct guncon2_state){
+                .timestamp = timestamp,
+                .msc_timestamp = guncon2->msc_timestamp,
+                .x = x,
+                .y = y,
+                .buttons = buttons,
+                .hat_x = report.hat_x,
+                .hat_y = report.hat_y,
+                .offscreen = offscreen,
+                .has_position = !offscreen || guncon2->have_position,
+        };
+        if (have_shot && !(shot.flags & GUNCON2_SAMPLE_OFFSCREEN)) {
+            state.shot = true;
+            state.shot_x = shot.x;
+            state.shot_y = shot.y;
+        }
+
+        if (guncon2_report_state(guncon2, params, &state)) {
+            /* only real activity keeps the gun from autosuspending */
+            usb_mark_last_busy(urb->dev);
+            guncon2_hist_add(guncon2->stats.process_hist, ktime_to_ns(ktime_sub(ktime_get(), timestamp)));
+        }
+        rcu_read_unlock();
+
+        guncon2->have_last = true;
+        if (!offscreen) {
+            guncon2->have_position = true;
+            guncon2->last_x = x;
+            guncon2->last_y = y;
+        }
+    } else {
+        atomic_long_inc(&guncon2->stats.short_reads);
+    }
+
+    /* Resubmit to fetch new fresh URBs */
+    usb_anchor_urb(urb, &guncon2->submitted);
+    error = usb_submit_urb(urb, GFP_ATOMIC);
+    trace_guncon2_resubmit(urb, error);
+    if (error) {
+        usb_unanchor_urb(urb);
+        if (error != -EPERM) {
+            atomic_long_inc(&guncon2->stats.resubmit_failures);
+            dev_err(&guncon2->intf->dev,
+                    "%s - usb_submit_urb failed with result: %d",
+                    __func__, error);
+        }
+    }
+}
+
+#define GUNCON2_DEFINE_IRQ(model)                              \
+    static void guncon2_usb_irq_##model(struct urb *urb) {     \
+        guncon2_usb_irq(urb, guncon2_decode_##model);          \
+    }
+
+GUNCON2_DEFINE_IRQ(guncon2)
+
+/* Supported models, indexed by the driver_info of the device table */
+enum guncon2_model_id {
+    GUNCON2_MODEL_GUNCON2,
+};
+
+struct guncon2_model {
+    const char *name;
+    unsigned int report_len;
+    usb_complete_t complete;
+};
+
+static const struct guncon2_model guncon2_models[] = {
+        [GUNCON2_MODEL_GUNCON2] = {
+                .name = "Namco GunCon 2",
+                .report_len = 6,
+                .complete = guncon2_usb_irq_guncon2,
+        },
+};
+
+/* Stop everything the completion path can restart */
+static void guncon2_kill_urbs(struct guncon2 *guncon2) {
+    WRITE_ONCE(guncon2->running, false);
+    usb_kill_anchored_urbs(&guncon2->submitted);
+
+    /* the work may have resubmitted URBs before it was cancelled */
+    cancel_delayed_work_sync(&guncon2->resubmit_work);
+    usb_kill_anchored_urbs(&guncon2->submitted);
+    usb_scuttle_anchored_urbs(&guncon2->deferred);
+
+    /* the mode is sent again on the next open or resume */
+    usb_kill_urb(guncon2->mode_urb);
+    cancel_delayed_work_sync(&guncon2->mode_timeout);
+
+    /* let the stop sent when the effects are flushed on close reach the solenoid */
+    spin_lock_irq(&guncon2->recoil_lock);
+    guncon2->recoil_pending = false;
+    spin_unlock_irq(&guncon2->recoil_lock);
+    usb_wait_anchor_empty_timeout(&guncon2->recoil_submitted, GUNCON2_RECOIL_DRAIN_MS);
+    usb_kill_anchored_urbs(&guncon2->recoil_submitted);
+
+    /* a state held back now is stale by the time the URBs are restarted */
+    hrtimer_cancel(&guncon2->coalesce_timer);
+    guncon2->have_pending = false;
+
+    /* nothing is coming in any more */
+    atomic_long_set(&guncon2->stats.packets_per_sec, 0);
+}
+
+/*
+ * Queue every URB in the pool on the interrupt endpoint. Either all of them
+ * end up anchored and in flight or none of them do.
+ */
+static int guncon2_submit_urbs(struct guncon2 *guncon2, gfp_t mem_flags) {
+    unsigned int i;
+    int error;
+
+    guncon2->backoff_ms = 0;
+    WRITE_ONCE(guncon2->running, true);
+
+    /* the completion handler is stopped, start a new rate window and don't count the gap as an interval */
+    guncon2->stats.window_start = ktime_get();
+    guncon2->stats.last_completion = 0;
+    guncon2->stats.window_packets = 0;
+
+    for (i = 0; i < guncon2->num_urbs; i++) {
+        usb_anchor_urb(guncon2->urbs[i], &guncon2->submitted);
+        error = usb_submit_urb(guncon2->urbs[i], mem_flags);
+        if (error) {
+            usb_unanchor_urb(guncon2->urbs[i]);
+            guncon2_kill_urbs(guncon2);
+            return error;
+        }
+    }
+
+    /* the submit has rounded the interval to frames or microframes the host actually polls at */
+    if (guncon2->urbs[0]->dev->speed == USB_SPEED_LOW || guncon2->urbs[0]->dev->speed == USB_SPEED_FULL)
+        WRITE_ONCE(guncon2->interval_us, guncon2->urbs[0]->interval * USEC_PER_MSEC);
+    else
+        WRITE_ONCE(guncon2->interval_us, guncon2->urbs[0]->interval * 125);
+
+    return 0;
+}
+
+static void guncon2_resubmit_work(struct work_struct *work) {
+    struct guncon2 *guncon2 = container_of(to_delayed_work(work), struct guncon2, resubmit_work);
+    struct urb *urb;
+    int error;
+
+    while ((urb = usb_get_from_anchor(&guncon2->deferred))) {
+        if (READ_ONCE(guncon2->running)) {
+            usb_anchor_urb(urb, &guncon2->submitted);
+            error = usb_submit_urb(urb, GFP_KERNEL);
+            trace_guncon2_resubmit(urb, error);
+            if (error) {
+                usb_unanchor_urb(urb);
+                atomic_long_inc(&guncon2->stats.resubmit_failures);
+                dev_err(&guncon2->intf->dev,
+                        "%s - usb_submit_urb failed with result: %d",
+                        __func__, error);
+            }
+        }
+
+        /* drop the reference taken by usb_get_from_anchor */
+        usb_free_urb(urb);
+    }
+}
+
+/* Submit mode_next, must be called with the mode_lock held and no mode URB in flight */
+static int guncon2_submit_mode(struct guncon2 *guncon2) {
+    int error;
+
+    guncon2->mode_msg->mode = guncon2->mode_next;
+    guncon2->mode_pending = false;
+    guncon2->mode_timed_out = false;
+
+    error = usb_submit_urb(guncon2->mode_urb, GFP_ATOMIC);
+    if (error) {
+        /* try again with the next send, or once the gun is resumed */
+        guncon2->mode_pending = true;
+        return error;
+    }
+
+    guncon2->mode_busy = true;
+    guncon2->mode_deadline = jiffies + msecs_to_jiffies(GUNCON2_MODE_TIMEOUT_MS);
+    mod_delayed_work(system_wq, &guncon2->mode_timeout, msecs_to_jiffies(GUNCON2_MODE_TIMEOUT_MS));
+    return 0;
+}
+
+static void guncon2_mode_complete(struct urb *urb) {
+    struct guncon2 *guncon2 = urb->context;
+    int status = urb->status;
+    unsigned long flags;
+    int error;
+
+    spin_lock_irqsave(&guncon2->mode_lock, flags);
+    guncon2->mode_busy = false;
+    if (guncon2->mode_timed_out)
+        status = -ETIMEDOUT;
+
+    switch (status) {
+        case 0:
+        case -ENOENT:
+        case -ESHUTDOWN:
+        case -ENODEV:
+            break;
+        default:
+            atomic_long_inc(&guncon2->stats.mode_errors);
+            dev_err(&guncon2->intf->dev, "%s - failed to set the sampling mode, error: %d\n",
+                    __func__, status);
+            break;
+    }
+
+    if (guncon2->mode_pending) {
+        /* fails with -EPERM while the URB is being killed, that keeps it pending */
+        error = guncon2_submit_mode(guncon2);
+        if (error && error != -EPERM)
+            dev_err(&guncon2->intf->dev, "%s - usb_submit_urb failed, error: %d\n",
+                    __func__, error);
+    }
+
+    if (!guncon2->mode_busy)
+        cancel_delayed_work(&guncon2->mode_timeout);
+    spin_unlock_irqrestore(&guncon2->mode_lock, flags);
+}
+
+static void guncon2_mode_timeout(struct work_struct *work) {
+    struct guncon2 *guncon2 = container_of(to_delayed_work(work), struct guncon2, mode_timeout);
+
+    spin_lock_irq(&guncon2->mode_lock);
+    if (guncon2->mode_busy && !guncon2->mode_timed_out &&
+        time_after_eq(jiffies, guncon2->mode_deadline)) {
+        guncon2->mode_timed_out = true;
+        usb_unlink_urb(guncon2->mode_urb);
+    }
+    spin_unlock_irq(&guncon2->mode_lock);
+}
+
+/*
+ * Queue the current sampling mode to be sent to the device, must be called
+ * with the pm_mutex held. This does not wait for the device, a failure to
+ * set the mode is logged and counted in the debugfs stats.
+ */
+static int guncon2_send_mode(struct guncon2 *guncon2) {
+    unsigned long flags;
+    int error = 0;
+
+    spin_lock_irqsave(&guncon2->mode_lock, flags);
+    guncon2->mode_next = guncon2->mode;
+    if (guncon2->mode_busy)
+        guncon2->mode_pending = true;
+    else
+        error = guncon2_submit_mode(guncon2);
+    spin_unlock_irqrestore(&guncon2->mode_lock, flags);
+
+    return error;
+}
+
+/* Send a recoil strength on an idle URB, must be called with the recoil_lock held */
+static void guncon2_recoil_submit(struct guncon2 *guncon2, u8 strength) {
+    unsigned int i = find_first_bit(&guncon2->recoil_idle, GUNCON2_RECOIL_URBS);
+    struct urb *urb;
+    int error;
+
+    if (i >= GUNCON2_RECOIL_URBS || guncon2->recoil_suspended) {
+        guncon2->recoil_next = strength;
+        guncon2->recoil_pending = true;
+        /* sent by guncon2_resume, once the reference has woken the gun up */
+        if (guncon2->recoil_suspended && !guncon2->recoil_wake)
+            guncon2->recoil_wake = !usb_autopm_get_interface_async(guncon2->intf);
+        return;
+    }
+
+    urb = guncon2->recoil_urbs[i];
+    guncon2->recoil_msgs[i].strength = strength;
+    __clear_bit(i, &guncon2->recoil_idle);
+    guncon2->recoil_pending = false;
+
+    /* dropped by guncon2_recoil_complete */
+    error = usb_autopm_get_interface_async(guncon2->intf);
+    if (!error) {
+        usb_anchor_urb(urb, &guncon2->recoil_submitted);
+        error = usb_submit_urb(urb, GFP_ATOMIC);
+        if (error) {
+            usb_unanchor_urb(urb);
+            usb_autopm_put_interface_async(guncon2->intf);
+        }
+    }
+    if (error) {
+        __set_bit(i, &guncon2->recoil_idle);
+        /* fire and forget, a lost pulse is not worth retrying */
+        atomic_long_inc(&guncon2->stats.recoil_errors);
+        return;
+    }
+
+    guncon2->recoil_sent = strength;
+    usb_mark_last_busy(interface_to_usbdev(guncon2->intf));
+}
+
+static void guncon2_recoil_complete(struct urb *urb) {
+    struct guncon2 *guncon2 = urb->context;
+    unsigned long flags;
+    unsigned int i;
+
+    switch (urb->status) {
+        case 0:
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+        case -ENODEV:
+            break;
+        default:
+            atomic_long_inc(&guncon2->stats.recoil_errors);
+            dev_dbg(&guncon2->intf->dev, "%s - failed to send recoil, error: %d\n", __func__, urb->status);
+            break;
+    }
+
+    spin_lock_irqsave(&guncon2->recoil_lock, flags);
+    for (i = 0; i < GUNCON2_RECOIL_URBS; i++) {
+        if (guncon2->recoil_urbs[i] == urb)
+            __set_bit(i, &guncon2->recoil_idle);
+    }
+    if (guncon2->recoil_pending)
+        guncon2_recoil_submit(guncon2, guncon2->recoil_next);
+    spin_unlock_irqrestore(&guncon2->recoil_lock, flags);
+
+    usb_autopm_put_interface_async(guncon2->intf);
+}
+
+/* Force feedback playback, called from the memless timer with interrupts off */
+static int guncon2_play_effect(struct input_dev *input, void *data, struct ff_effect *effect) {
+    struct guncon2 *guncon2 = input_get_drvdata(input);
+    u8 strength;
+
+    if (effect->type != FF_RUMBLE)
+        return 0;
+
+    strength = max(effect->u.rumble.strong_magnitude, effect->u.rumble.weak_magnitude) >> 8;
+
+    spin_lock(&guncon2->recoil_lock);
+    /* a burst of effects collapses to the latest strength, repeats are dropped */
+    if (strength != (guncon2->recoil_pending ? guncon2->recoil_next : guncon2->recoil_sent))
+        guncon2_recoil_submit(guncon2, strength);
+    spin_unlock(&guncon2->recoil_lock);
+
+    return 0;
+}
+
+/* Replace the sampling mode and send it if the gun is running */
+static int guncon2_set_mode(struct guncon2 *guncon2, const struct gc_mode *mode) {
+    int error;
+
+    error = usb_autopm_get_interface(guncon2->intf);
+    if (error)
+        return error;
+
+    mutex_lock(&guncon2->pm_mutex);
+    guncon2->mode = *mode;
+    if (guncon2->is_open)
+        error = guncon2_send_mode(guncon2);
+    mutex_unlock(&guncon2->pm_mutex);
+
+    usb_autopm_put_interface(guncon2->intf);
+    return error;
+}
+
+/*
+ * Start reading reports for a new user (the input device, the sample ring
+ * or the aggregate device). The gun is resumed before the pm_mutex is taken
+ * as the resume handler takes it too; once open it is allowed to autosuspend
+ * again and relies on remote wakeup to resume.
+ */
+static int guncon2_start_io(struct guncon2 *guncon2) {
+    int retval;
+
+    retval = usb_autopm_get_interface(guncon2->intf);
+    if (retval)
+        return retval;
+
+    mutex_lock(&guncon2->pm_mutex);
+    if (guncon2->users++)
+        goto out;
+
+    retval = guncon2_send_mode(guncon2);
+    if (retval)
+        dev_err(&guncon2->intf->dev, "%s - failed to send the sampling mode, error: %d\n",
+                __func__, retval);
+
+    /* the first report after opening always carries the full state */
+    guncon2->have_last = false;
+    guncon2->have_position = false;
+    guncon2->have_valid = false;
+    guncon2->quality_have_last = false;
+    guncon2->shot_pending = false;
+    guncon2->have_reported = false;
+    guncon2->filter.primed = false;
+    guncon2->predictor.primed = false;
+
+    retval = guncon2_submit_urbs(guncon2, GFP_KERNEL);
+    if (retval) {
+        dev_err(&guncon2->intf->dev,
+                "%s - usb_submit_urb failed, error: %d\n",
+                __func__, retval);
+        guncon2->users--;
+        retval = -EIO;
+        goto out;
+    }
+
+    guncon2->intf->needs_remote_wakeup = 1;
+    guncon2->is_open = true;
+
+out:
+    mutex_unlock(&guncon2->pm_mutex);
+    usb_autopm_put_interface(guncon2->intf);
+    return retval;
+}
+
+/* Drop a user, the last one stops the URBs */
+static void guncon2_stop_io(struct guncon2 *guncon2) {
+    int autopm = usb_autopm_get_interface(guncon2->intf);
+
+    mutex_lock(&guncon2->pm_mutex);
+    if (!--guncon2->users) {
+        guncon2_kill_urbs(guncon2);
+        guncon2->intf->needs_remote_wakeup = 0;
+        guncon2->is_open = false;
+    }
+    mutex_unlock(&guncon2->pm_mutex);
+
+    if (!autopm)
+        usb_autopm_put_interface(guncon2->intf);
+}
+
+static int guncon2_open(struct input_dev *input) {
+    struct guncon2 *guncon2 = input_get_drvdata(input);
+    bool early;
+
+    /* the first open takes over the user started by probe */
+    mutex_lock(&guncon2->pm_mutex);
+    early = guncon2->early_user;
+    guncon2->early_user = false;
+    mutex_unlock(&guncon2->pm_mutex);
+
+    if (early)
+        return 0;
+
+    return guncon2_start_io(guncon2);
+}
+
+static void guncon2_close(struct input_dev *input) {
+    struct guncon2 *guncon2 = input_get_drvdata(input);
+
+    guncon2_stop_io(guncon2);
+}
+
+static void guncon2_early_stop(void *context) {
+    struct guncon2 *guncon2 = context;
+    bool early;
+
+    mutex_lock(&guncon2->pm_mutex);
+    early = guncon2->early_user;
+    guncon2->early_user = false;
+    mutex_unlock(&guncon2->pm_mutex);
+
+    if (early)
+        guncon2_stop_io(guncon2);
+}
+
+/*
+ * Start sampling from probe, so the mode is set and reports are flowing by
+ * the time the input device is registered. The user is handed over to the
+ * first open of the input device, or dropped when the gun goes away.
+ */
+static int guncon2_early_start(struct guncon2 *guncon2) {
+    int error;
+
+    error = guncon2_start_io(guncon2);
+    if (error) {
+        /* not fatal, the gun is started by the first open instead */
+        dev_warn(&guncon2->intf->dev, "%s - early start failed, error: %d\n", __func__, error);
+        return 0;
+    }
+
+    /* nothing else can see the gun before the input device is registered */
+    guncon2->early_user = true;
+
+    return devm_add_action_or_reset(&guncon2->intf->dev, guncon2_early_stop, guncon2);
+}
+
+static void guncon2_ring_free(struct kref *kref) {
+    struct guncon2_ring *ring = container_of(kref, struct guncon2_ring, kref);
+
+    ida_free(&guncon2_ring_ida, ring->id);
+    vfree(ring->hdr);
+    kfree(ring);
+}
+
+static int guncon2_ring_open(struct inode *inode, struct file *file) {
+    struct guncon2_ring *ring = container_of(file->private_data, struct guncon2_ring, misc);
+    int retval = 0;
+
+    mutex_lock(&ring->lock);
+    if (!ring->guncon2) {
+        retval = -ENODEV;
+    } else if (ring->busy) {
+        /* there is only one consumer index */
+        retval = -EBUSY;
+    } else {
+        /* nothing is pushed while the ring is closed, start from an empty ring */
+        WRITE_ONCE(ring->hdr->tail, ring->head);
+        ring->dropped = 0;
+        WRITE_ONCE(ring->hdr->dropped, 0);
+        retval = guncon2_start_io(ring->guncon2);
+    }
+
+    if (!retval) {
+        WRITE_ONCE(ring->busy, true);
+        kref_get(&ring->kref);
+        file->private_data = ring;
+    }
+    mutex_unlock(&ring->lock);
+
+    return retval;
+}
+
+static int guncon2_ring_release(struct inode *inode, struct file *file) {
+    struct guncon2_ring *ring = file->private_data;
+
+    mutex_lock(&ring->lock);
+    if (ring->guncon2)
+        guncon2_stop_io(ring->guncon2);
+    WRITE_ONCE(ring->busy, false);
+    mutex_unlock(&ring->lock);
+
+    kref_put(&ring->kref, guncon2_ring_free);
+    return 0;
+}
+
+static __poll_t guncon2_ring_poll(struct file *file, poll_table *wait) {
+    struct guncon2_ring *ring = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &ring->wait, wait);
+
+    if (smp_load_acquire(&ring->hdr->head) != READ_ONCE(ring->hdr->tail))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!READ_ONCE(ring->guncon2))
+        mask |= EPOLLHUP | EPOLLERR;
+
+    return mask;
+}
+
+/* Read whole samples, this consumes them like advancing tail in the mapping does */
+static ssize_t guncon2_ring_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    struct guncon2_ring *ring = file->private_data;
+    struct guncon2_sample *sample;
+    size_t copied = 0;
+    u32 head, tail;
+    int error;
+
+    if (count < sizeof(*sample))
+        return -EINVAL;
+
+    for (;;) {
+        mutex_lock(&ring->lock);
+        head = smp_load_acquire(&ring->hdr->head);
+        tail = READ_ONCE(ring->hdr->tail);
+
+        /* a consumer index moved past head through the mapping is reset */
+        if (head - tail > GUNCON2_RING_ENTRIES)
+            tail = head;
+
+        while (tail != head && count - copied >= sizeof(*sample)) {
+            sample = &ring->entries[tail & (GUNCON2_RING_ENTRIES - 1)];
+            if (copy_to_user(buf + copied, sample, sizeof(*sample))) {
+                mutex_unlock(&ring->lock);
+                return copied ? copied : -EFAULT;
+            }
+            copied += sizeof(*sample);
+            smp_store_release(&ring->hdr->tail, ++tail);
+        }
+
+        if (copied || !ring->guncon2) {
+            mutex_unlock(&ring->lock);
+            return copied;
+        }
+        mutex_unlock(&ring->lock);
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        error = wait_event_interruptible(ring->wait, smp_load_acquire(&ring->hdr->head) !=
+                                                     READ_ONCE(ring->hdr->tail) || !READ_ONCE(ring->guncon2));
+        if (error)
+            return error;
+    }
+}
+
+/* A write is the 6-byte mode report, sent to the gun like a sysfs mode change */
+static ssize_t guncon2_ring_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct guncon2_ring *ring = file->private_data;
+    struct gc_mode mode;
+    int error;
+
+    if (count != sizeof(mode))
+        return -EINVAL;
+    if (copy_from_user(&mode, buf, sizeof(mode)))
+        return -EFAULT;
+
+    mutex_lock(&ring->lock);
+    error = ring->guncon2 ? guncon2_set_mode(ring->guncon2, &mode) : -ENODEV;
+    mutex_unlock(&ring->lock);
+
+    return error ?: count;
+}
+
+static int guncon2_ring_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct guncon2_ring *ring = file->private_data;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->size)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, ring->hdr, 0);
+}
+
+static const struct file_operations guncon2_ring_fops = {
+        .owner = THIS_MODULE,
+        .open = guncon2_ring_open,
+        .release = guncon2_ring_release,
+        .read = guncon2_ring_read,
+        .write = guncon2_ring_write,
+        .poll = guncon2_ring_poll,
+        .mmap = guncon2_ring_mmap,
+        .llseek = noop_llseek,
+};
+
+static void guncon2_ring_destroy(void *context) {
+    struct guncon2 *guncon2 = context;
+    struct guncon2_ring *ring = guncon2->ring;
+
+    if (ring->registered)
+        misc_deregister(&ring->misc);
+
+    /* detach from any open file, which keeps the ring itself alive */
+    mutex_lock(&ring->lock);
+    if (ring->busy)
+        guncon2_stop_io(guncon2);
+    WRITE_ONCE(ring->guncon2, NULL);
+    mutex_unlock(&ring->lock);
+    wake_up_interruptible_poll(&ring->wait, EPOLLHUP | EPOLLERR);
+
+    guncon2->ring = NULL;
+    kref_put(&ring->kref, guncon2_ring_free);
+}
+
+static int guncon2_ring_create(struct guncon2 *guncon2) {
+    struct guncon2_ring *ring;
+    int error;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->id = ida_alloc(&guncon2_ring_ida, GFP_KERNEL);
+    if (ring->id < 0) {
+        error = ring->id;
+        kfree(ring);
+        return error;
+    }
+
+    kref_init(&ring->kref);
+    mutex_init(&ring->lock);
+    init_waitqueue_head(&ring->wait);
+    ring->guncon2 = guncon2;
+
+    ring->size = PAGE_ALIGN(PAGE_SIZE + GUNCON2_RING_ENTRIES * sizeof(struct guncon2_sample));
+    ring->hdr = vmalloc_user(ring->size);
+    if (!ring->hdr) {
+        kref_put(&ring->kref, guncon2_ring_free);
+        return -ENOMEM;
+    }
+
+    ring->hdr->version = GUNCON2_RING_VERSION;
+    ring->hdr->entries = GUNCON2_RING_ENTRIES;
+    ring->hdr->entry_size = sizeof(struct guncon2_sample);
+    ring->hdr->data_offset = PAGE_SIZE;
+    ring->entries = (void *) ring->hdr + PAGE_SIZE;
+
+    snprintf(ring->name, sizeof(ring->name), "guncon2-%d", ring->id);
+    ring->misc.minor = MISC_DYNAMIC_MINOR;
+    ring->misc.name = ring->name;
+    ring->misc.fops = &guncon2_ring_fops;
+    ring->misc.parent = &guncon2->intf->dev;
+
+    guncon2->ring = ring;
+    return devm_add_action_or_reset(&guncon2->intf->dev, guncon2_ring_destroy, guncon2);
+}
+
+/* Make the ring visible, once the input device is set up and reports can be decoded */
+static int guncon2_ring_register(struct guncon2 *guncon2) {
+    int error;
+
+    if (!guncon2->ring)
+        return 0;
+
+    error = misc_register(&guncon2->ring->misc);
+    if (error)
+        return error;
+
+    guncon2->ring->registered = true;
+    return 0;
+}
+
+/*
+ * Aggregate device, opening it starts every registered gun and every gun
+ * that is connected while it is open.
+ */
+struct guncon2_agg_reader {
+    u32 sequence; // last frame read
+};
+
+/* Must be called with the aggregate mutex held */
+static void guncon2_agg_start(struct guncon2 *guncon2) {
+    if (!guncon2_start_io(guncon2))
+        guncon2->agg_user = true;
+}
+
+/* Must be called with the aggregate mutex held */
+static void guncon2_agg_stop(struct guncon2 *guncon2) {
+    if (!guncon2->agg_user)
+        return;
+
+    guncon2_stop_io(guncon2);
+    guncon2->agg_user = false;
+}
+
+static int guncon2_agg_open(struct inode *inode, struct file *file) {
+    struct guncon2_agg_reader *reader;
+    unsigned int i;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!reader)
+        return -ENOMEM;
+
+    mutex_lock(&guncon2_agg.mutex);
+    if (!guncon2_agg.readers++) {
+        for (i = 0; i < GUNCON2_AGG_MAX_GUNS; i++) {
+            if (guncon2_agg.guns[i])
+                guncon2_agg_start(guncon2_agg.guns[i]);
+        }
+    }
+    mutex_unlock(&guncon2_agg.mutex);
+
+    /* only frames published after opening are returned */
+    spin_lock_irq(&guncon2_agg.lock);
+    reader->sequence = guncon2_agg.published.sequence;
+    spin_unlock_irq(&guncon2_agg.lock);
+
+    file->private_data = reader;
+    return nonseekable_open(inode, file);
+}
+
+static int guncon2_agg_release(struct inode *inode, struct file *file) {
+    unsigned int i;
+
+    mutex_lock(&guncon2_agg.mutex);
+    if (!--guncon2_agg.readers) {
+        for (i = 0; i < GUNCON2_AGG_MAX_GUNS; i++) {
+            if (guncon2_agg.guns[i])
+                guncon2_agg_stop(guncon2_agg.guns[i]);
+        }
+    }
+    mutex_unlock(&guncon2_agg.mutex);
+
+    kfree(file->private_data);
+    return 0;
+}
+
+static bool guncon2_agg_fresh(struct guncon2_agg_reader *reader) {
+    return READ_ONCE(guncon2_agg.published.sequence) != reader->sequence;
+}
+
+static ssize_t guncon2_agg_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    struct guncon2_agg_reader *reader = file->private_data;
+    struct guncon2_frame frame;
+    bool fresh;
+    int error;
+
+    if (count < sizeof(frame))
+        return -EINVAL;
+
+    for (;;) {
+        spin_lock_irq(&guncon2_agg.lock);
+        fresh = guncon2_agg.published.sequence != reader->sequence;
+        if (fresh)
+            frame = guncon2_agg.published;
+        spin_unlock_irq(&guncon2_agg.lock);
+
+        if (fresh)
+            break;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        error = wait_event_interruptible(guncon2_agg.wait, guncon2_agg_fresh(reader));
+        if (error)
+            return error;
+    }
+
+    reader->sequence = frame.sequence;
+    if (copy_to_user(buf, &frame, sizeof(frame)))
+        return -EFAULT;
+
+    return sizeof(frame);
+}
+
+static __poll_t guncon2_agg_poll(struct file *file, poll_table *wait) {
+    struct guncon2_agg_reader *reader = file->private_data;
+
+    poll_wait(file, &guncon2_agg.wait, wait);
+
+    return guncon2_agg_fresh(reader) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations guncon2_agg_fops = {
+        .owner = THIS_MODULE,
+        .open = guncon2_agg_open,
+        .release = guncon2_agg_release,
+        .read = guncon2_agg_read,
+        .poll = guncon2_agg_poll,
+};
+
+static struct miscdevice guncon2_agg_misc = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = "guncon2-aggregate",
+        .fops = &guncon2_agg_fops,
+};
+
+static void guncon2_agg_remove(void *context) {
+    struct guncon2 *guncon2 = context;
+    int slot = guncon2->agg_slot;
+
+    mutex_lock(&guncon2_agg.mutex);
+    spin_lock_irq(&guncon2_agg.lock);
+    WRITE_ONCE(guncon2->agg_slot, -1);
+    __clear_bit(slot, &guncon2_agg.connected);
+    memset(&guncon2_agg.current_frame.guns[slot], 0, sizeof(struct guncon2_gun_state));
+    spin_unlock_irq(&guncon2_agg.lock);
+
+    guncon2_agg.guns[slot] = NULL;
+    guncon2_agg_stop(guncon2);
+    mutex_unlock(&guncon2_agg.mutex);
+}
+
+/* Add a gun to a free slot of the aggregate device */
+static int guncon2_agg_add(struct guncon2 *guncon2) {
+    int slot;
+
+    if (!enable_aggregate)
+        return 0;
+
+    mutex_lock(&guncon2_agg.mutex);
+    for (slot = 0; slot < GUNCON2_AGG_MAX_GUNS; slot++) {
+        if (!guncon2_agg.guns[slot])
+            break;
+    }
+    if (slot == GUNCON2_AGG_MAX_GUNS) {
+        mutex_unlock(&guncon2_agg.mutex);
+        dev_warn(&guncon2->intf->dev, "no free slot in the aggregate device\n");
+        return 0;
+    }
+
+    guncon2_agg.guns[slot] = guncon2;
+    spin_lock_irq(&guncon2_agg.lock);
+    WRITE_ONCE(guncon2->agg_slot, slot);
+    __set_bit(slot, &guncon2_agg.connected);
+    guncon2_agg.current_frame.guns[slot].flags = GUNCON2_GUN_CONNECTED;
+    spin_unlock_irq(&guncon2_agg.lock);
+
+    if (guncon2_agg.readers)
+        guncon2_agg_start(guncon2);
+    mutex_unlock(&guncon2_agg.mutex);
+
+    return devm_add_action_or_reset(&guncon2->intf->dev, guncon2_agg_remove, guncon2);
+}
+
+/*
+ * Sampling mode attributes, a change is sent straight to the device if it
+ * is currently open.
+ */
+static struct guncon2 *guncon2_lock_mode(struct device *dev) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    mutex_lock(&guncon2->pm_mutex);
+    return guncon2;
+}
+
+/* Lock the mode for an update, with the gun resumed so the update can be sent */
+static struct guncon2 *guncon2_begin_mode_update(struct device *dev) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    int error;
+
+    error = usb_autopm_get_interface(guncon2->intf);
+    if (error)
+        return ERR_PTR(error);
+
+    mutex_lock(&guncon2->pm_mutex);
+    return guncon2;
+}
+
+static ssize_t guncon2_commit_mode(struct guncon2 *guncon2, size_t count) {
+    int error = 0;
+
+    if (guncon2->is_open)
+        error = guncon2_send_mode(guncon2);
+    mutex_unlock(&guncon2->pm_mutex);
+    usb_autopm_put_interface(guncon2->intf);
+
+    return error ? error : count;
+}
+
+static ssize_t refresh_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = guncon2_lock_mode(dev);
+    unsigned int rate = guncon2->mode.mode & GUNCON2_MODE_50HZ ? 50 : 60;
+
+    mutex_unlock(&guncon2->pm_mutex);
+    return sysfs_emit(buf, "%u\n", rate);
+}
+
+static ssize_t refresh_rate_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count) {
+    struct guncon2 *guncon2;
+    unsigned int rate;
+    int error;
+
+    error = kstrtouint(buf, 10, &rate);
+    if (error)
+        return error;
+    if (rate != 50 && rate != 60)
+        return -EINVAL;
+
+    guncon2 = guncon2_begin_mode_update(dev);
+    if (IS_ERR(guncon2))
+        return PTR_ERR(guncon2);
+    if (rate == 50)
+        guncon2->mode.mode |= GUNCON2_MODE_50HZ;
+    else
+        guncon2->mode.mode &= ~GUNCON2_MODE_50HZ;
+
+    return guncon2_commit_mode(guncon2, count);
+}
+static DEVICE_ATTR_RW(refresh_rate);
+
+static ssize_t interlace_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = guncon2_lock_mode(dev);
+    bool enabled = guncon2->mode.mode & GUNCON2_MODE_INTERLACE;
+
+    mutex_unlock(&guncon2->pm_mutex);
+    return sysfs_emit(buf, "%d\n", enabled);
+}
+
+static ssize_t interlace_store(struct device *dev, struct device_attribute *attr,
+                               const char *buf, size_t count) {
+    struct guncon2 *guncon2;
+    bool enable;
+    int error;
+
+    error = kstrtobool(buf, &enable);
+    if (error)
+        return error;
+
+    guncon2 = guncon2_begin_mode_update(dev);
+    if (IS_ERR(guncon2))
+        return PTR_ERR(guncon2);
+    if (enable)
+        guncon2->mode.mode |= GUNCON2_MODE_INTERLACE;
+    else
+        guncon2->mode.mode &= ~GUNCON2_MODE_INTERLACE;
+
+    return guncon2_commit_mode(guncon2, count);
+}
+static DEVICE_ATTR_RW(interlace);
+
+static ssize_t x_offset_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = guncon2_lock_mode(dev);
+    s16 offset = le16_to_cpu(guncon2->mode.x_offset);
+
+    mutex_unlock(&guncon2->pm_mutex);
+    return sysfs_emit(buf, "%d\n", offset);
+}
+
+static ssize_t x_offset_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t count) {
+    struct guncon2 *guncon2;
+    s16 offset;
+    int error;
+
+    error = kstrtos16(buf, 10, &offset);
+    if (error)
+        return error;
+
+    guncon2 = guncon2_begin_mode_update(dev);
+    if (IS_ERR(guncon2))
+        return PTR_ERR(guncon2);
+    guncon2->mode.x_offset = cpu_to_le16(offset);
+
+    return guncon2_commit_mode(guncon2, count);
+}
+static DEVICE_ATTR_RW(x_offset);
+
+static ssize_t y_offset_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = guncon2_lock_mode(dev);
+    s8 offset = guncon2->mode.y_offset;
+
+    mutex_unlock(&guncon2->pm_mutex);
+    return sysfs_emit(buf, "%d\n", offset);
+}
+
+static ssize_t y_offset_store(struct device *dev, struct device_attribute *attr,
+                              const char *buf, size_t count) {
+    struct guncon2 *guncon2;
+    s8 offset;
+    int error;
+
+    error = kstrtos8(buf, 10, &offset);
+    if (error)
+        return error;
+
+    guncon2 = guncon2_begin_mode_update(dev);
+    if (IS_ERR(guncon2))
+        return PTR_ERR(guncon2);
+    guncon2->mode.y_offset = offset;
+
+    return guncon2_commit_mode(guncon2, count);
+}
+static DEVICE_ATTR_RW(y_offset);
+
+static void guncon2_set_abs_range(struct input_dev *input, unsigned int axis, int min, int max) {
+    spin_lock_irq(&input->event_lock);
+    input_abs_set_min(input, axis, min);
+    input_abs_set_max(input, axis, max);
+    spin_unlock_irq(&input->event_lock);
+}
+
+/* Load a screen mapping, must be called with the pm_mutex held */
+static int guncon2_enable_matrix(struct guncon2 *guncon2, const s32 *m, u16 width, u16 height) {
+    struct input_dev *input = guncon2->input_device;
+    struct guncon2_params *params;
+
+    params = guncon2_params_begin(guncon2);
+    if (!params)
+        return -ENOMEM;
+
+    if (!params->cal_enabled) {
+        guncon2->raw_min[0] = input_abs_get_min(input, ABS_X);
+        guncon2->raw_max[0] = input_abs_get_max(input, ABS_X);
+        guncon2->raw_min[1] = input_abs_get_min(input, ABS_Y);
+        guncon2->raw_max[1] = input_abs_get_max(input, ABS_Y);
+    }
+
+    memcpy(params->cal_matrix, m, sizeof(params->cal_matrix));
+    params->cal_width = width;
+    params->cal_height = height;
+    params->cal_enabled = true;
+    guncon2_params_commit(guncon2, params);
+
+    guncon2_set_abs_range(input, ABS_X, 0, width - 1);
+    guncon2_set_abs_range(input, ABS_Y, 0, height - 1);
+
+    return 0;
+}
+
+/* Go back to raw positions, must be called with the pm_mutex held */
+static int guncon2_disable_matrix(struct guncon2 *guncon2) {
+    struct input_dev *input = guncon2->input_device;
+    struct guncon2_params *params;
+    bool was_enabled;
+
+    params = guncon2_params_begin(guncon2);
+    if (!params)
+        return -ENOMEM;
+
+    was_enabled = params->cal_enabled;
+    params->cal_enabled = false;
+    guncon2_params_commit(guncon2, params);
+
+    if (was_enabled) {
+        guncon2_set_abs_range(input, ABS_X, guncon2->raw_min[0], guncon2->raw_max[0]);
+        guncon2_set_abs_range(input, ABS_Y, guncon2->raw_min[1], guncon2->raw_max[1]);
+    }
+
+    return 0;
+}
+
+/*
+ * Screen mapping, written as "m0 m1 m2 m3 m4 m5 width height" with the
+ * matrix in Q16 fixed point. Writing "none" goes back to raw positions.
+ */
+static ssize_t calibration_matrix_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    const struct guncon2_params *params;
+    s32 m[6];
+    u16 width, height;
+    bool enabled;
+
+    rcu_read_lock();
+    params = rcu_dereference(guncon2->params);
+    enabled = params->cal_enabled;
+    memcpy(m, params->cal_matrix, sizeof(m));
+    width = params->cal_width;
+    height = params->cal_height;
+    rcu_read_unlock();
+
+    if (!enabled)
+        return sysfs_emit(buf, "none\n");
+
+    return sysfs_emit(buf, "%d %d %d %d %d %d %u %u\n",
+                      m[0], m[1], m[2], m[3], m[4], m[5], width, height);
+}
+
+static ssize_t calibration_matrix_store(struct device *dev, struct device_attribute *attr,
+                                        const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    s32 m[6];
+    unsigned int width, height;
+    int error;
+
+    if (sysfs_streq(buf, "none")) {
+        mutex_lock(&guncon2->pm_mutex);
+        error = guncon2_disable_matrix(guncon2);
+        mutex_unlock(&guncon2->pm_mutex);
+        return error ?: count;
+    }
+
+    if (sscanf(buf, "%d %d %d %d %d %d %u %u", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+               &width, &height) != 8)
+        return -EINVAL;
+    if (!width || !height || width > U16_MAX || height > U16_MAX)
+        return -EINVAL;
+
+    mutex_lock(&guncon2->pm_mutex);
+    error = guncon2_enable_matrix(guncon2, m, width, height);
+    mutex_unlock(&guncon2->pm_mutex);
+
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(calibration_matrix);
+
+/*
+ * Calibration store, keeps the calibration of each gun across disconnect
+ * and probe. Entries are keyed by the serial number of the gun when it has
+ * one and by its USB path otherwise. Connected guns are kept on a list as
+ * well, so an entry written to the module parameter is applied to a gun
+ * that is already connected instead of being overwritten on its disconnect.
+ */
+struct guncon2_calibration {
+    int x_min, x_max;
+    int y_min, y_max;
+    bool matrix;
+    s32 m[6];
+    u16 width, height;
+};
+
+struct guncon2_stored_cal {
+    struct list_head node;
+    char key[64];
+    struct guncon2_calibration cal;
+};
+
+static LIST_HEAD(guncon2_cal_list);
+static LIST_HEAD(guncon2_gun_list);
+static DEFINE_MUTEX(guncon2_cal_mutex);
+
+static struct guncon2_stored_cal *guncon2_find_cal(const char *key) {
+    struct guncon2_stored_cal *entry;
+
+    list_for_each_entry(entry, &guncon2_cal_list, node) {
+        if (!strcmp(entry->key, key))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Must be called with the guncon2_cal_mutex held */
+static int guncon2_store_cal(const char *key, const struct guncon2_calibration *cal) {
+    struct guncon2_stored_cal *entry;
+
+    entry = guncon2_find_cal(key);
+    if (!entry) {
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if (!entry)
+            return -ENOMEM;
+        strscpy(entry->key, key, sizeof(entry->key));
+        list_add_tail(&entry->node, &guncon2_cal_list);
+    }
+    entry->cal = *cal;
+
+    return 0;
+}
+
+static void guncon2_forget_cal(const char *key) {
+    struct guncon2_stored_cal *entry;
+
+    mutex_lock(&guncon2_cal_mutex);
+    entry = guncon2_find_cal(key);
+    if (entry) {
+        list_del(&entry->node);
+        kfree(entry);
+    }
+    mutex_unlock(&guncon2_cal_mutex);
+}
+
+static void guncon2_clear_cal(void) {
+    struct guncon2_stored_cal *entry, *tmp;
+
+    mutex_lock(&guncon2_cal_mutex);
+    list_for_each_entry_safe(entry, tmp, &guncon2_cal_list, node) {
+        list_del(&entry->node);
+        kfree(entry);
+    }
+    mutex_unlock(&guncon2_cal_mutex);
+}
+
+/*
+ * Apply a stored calibration, either while the gun is probed or to a gun
+ * that is already connected. The ranges are the raw ranges when there is a
+ * screen mapping, so the mapping is dropped before they are set.
+ */
+static int guncon2_apply_cal(struct guncon2 *guncon2, const struct guncon2_calibration *cal) {
+    int error;
+
+    mutex_lock(&guncon2->pm_mutex);
+    error = guncon2_disable_matrix(guncon2);
+    if (!error) {
+        guncon2_set_abs_range(guncon2->input_device, ABS_X, cal->x_min, cal->x_max);
+        guncon2_set_abs_range(guncon2->input_device, ABS_Y, cal->y_min, cal->y_max);
+
+        if (cal->matrix)
+            error = guncon2_enable_matrix(guncon2, cal->m, cal->width, cal->height);
+    }
+    mutex_unlock(&guncon2->pm_mutex);
+
+    return error;
+}
+
+/*
+ * Entries are written as "key x_min x_max y_min y_max", optionally followed
+ * by "m0 m1 m2 m3 m4 m5 width height" for a screen mapping. Several entries
+ * can be separated with ';' or newlines, a lone key removes its entry.
+ */
+static int guncon2_parse_cal(char *line) {
+    struct guncon2_calibration cal = {};
+    struct guncon2 *guncon2;
+    char key[64];
+    unsigned int width, height;
+    int error;
+    int n;
+
+    n = sscanf(line, "%63s %d %d %d %d %d %d %d %d %d %d %u %u", key,
+               &cal.x_min, &cal.x_max, &cal.y_min, &cal.y_max,
+               &cal.m[0], &cal.m[1], &cal.m[2], &cal.m[3], &cal.m[4], &cal.m[5],
+               &width, &height);
+    if (n == 1) {
+        guncon2_forget_cal(key);
+        return 0;
+    }
+    if (n != 5 && n != 13)
+        return -EINVAL;
+    if (cal.x_min >= cal.x_max || cal.y_min >= cal.y_max)
+        return -EINVAL;
+
+    if (n == 13) {
+        if (!width || !height || width > U16_MAX || height > U16_MAX)
+            return -EINVAL;
+        cal.matrix = true;
+        cal.width = width;
+        cal.height = height;
+    }
+
+    mutex_lock(&guncon2_cal_mutex);
+    error = guncon2_store_cal(key, &cal);
+    list_for_each_entry(guncon2, &guncon2_gun_list, cal_node) {
+        if (!error && !strcmp(guncon2->cal_key, key))
+            error = guncon2_apply_cal(guncon2, &cal);
+    }
+    mutex_unlock(&guncon2_cal_mutex);
+
+    return error;
+}
+
+static int guncon2_cal_param_set(const char *val, const struct kernel_param *kp) {
+    char *buf, *cur, *line;
+    int error = 0;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    cur = buf;
+    while (!error && (line = strsep(&cur, ";\n"))) {
+        line = strim(line);
+        if (*line)
+            error = guncon2_parse_cal(line);
+    }
+
+    kfree(buf);
+    return error;
+}
+
+static int guncon2_cal_param_get(char *buffer, const struct kernel_param *kp) {
+    struct guncon2_stored_cal *entry;
+    const struct guncon2_calibration *cal;
+    int len = 0;
+
+    mutex_lock(&guncon2_cal_mutex);
+    list_for_each_entry(entry, &guncon2_cal_list, node) {
+        cal = &entry->cal;
+        len += scnprintf(buffer + len, PAGE_SIZE - len, "%s %d %d %d %d", entry->key,
+                         cal->x_min, cal->x_max, cal->y_min, cal->y_max);
+        if (cal->matrix)
+            len += scnprintf(buffer + len, PAGE_SIZE - len, " %d %d %d %d %d %d %u %u",
+                             cal->m[0], cal->m[1], cal->m[2], cal->m[3], cal->m[4], cal->m[5],
+                             cal->width, cal->height);
+        len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+    }
+    mutex_unlock(&guncon2_cal_mutex);
+
+    return len;
+}
+
+static const struct kernel_param_ops guncon2_cal_param_ops = {
+        .set = guncon2_cal_param_set,
+        .get = guncon2_cal_param_get,
+};
+module_param_cb(calibration, &guncon2_cal_param_ops, NULL, 0644);
+MODULE_PARM_DESC(calibration, "Stored calibration, \"key x_min x_max y_min y_max [m0 .. m5 width height]\" entries separated by ';'");
+
+/* Restore the stored calibration of a gun being probed, parameter writes are applied to it from then on */
+static int guncon2_attach_cal(struct guncon2 *guncon2) {
+    struct guncon2_stored_cal *entry;
+    int error = 0;
+
+    mutex_lock(&guncon2_cal_mutex);
+    entry = guncon2_find_cal(guncon2->cal_key);
+    if (entry)
+        error = guncon2_apply_cal(guncon2, &entry->cal);
+    if (!error)
+        list_add_tail(&guncon2->cal_node, &guncon2_gun_list);
+    mutex_unlock(&guncon2_cal_mutex);
+
+    return error;
+}
+
+static void guncon2_detach_cal(void *context) {
+    struct guncon2 *guncon2 = context;
+
+    mutex_lock(&guncon2_cal_mutex);
+    list_del_init(&guncon2->cal_node);
+    mutex_unlock(&guncon2_cal_mutex);
+}
+
+/*
+ * Save the current calibration of a gun so it is restored the next time it
+ * is probed. The gun is taken off the list in the same critical section, so
+ * a parameter write either lands before the save and is saved with it or
+ * finds the gun gone and stays in the store as written.
+ */
+static void guncon2_save_cal(struct guncon2 *guncon2) {
+    struct input_dev *input = guncon2->input_device;
+    struct guncon2_calibration cal = {};
+    const struct guncon2_params *params;
+
+    mutex_lock(&guncon2_cal_mutex);
+    list_del_init(&guncon2->cal_node);
+
+    mutex_lock(&guncon2->pm_mutex);
+    rcu_read_lock();
+    params = rcu_dereference(guncon2->params);
+    cal.matrix = params->cal_enabled;
+    memcpy(cal.m, params->cal_matrix, sizeof(cal.m));
+    cal.width = params->cal_width;
+    cal.height = params->cal_height;
+    rcu_read_unlock();
+
+    if (cal.matrix) {
+        cal.x_min = guncon2->raw_min[0];
+        cal.x_max = guncon2->raw_max[0];
+        cal.y_min = guncon2->raw_min[1];
+        cal.y_max = guncon2->raw_max[1];
+    } else {
+        cal.x_min = input_abs_get_min(input, ABS_X);
+        cal.x_max = input_abs_get_max(input, ABS_X);
+        cal.y_min = input_abs_get_min(input, ABS_Y);
+        cal.y_max = input_abs_get_max(input, ABS_Y);
+    }
+    mutex_unlock(&guncon2->pm_mutex);
+
+    if (guncon2_store_cal(guncon2->cal_key, &cal))
+        dev_warn(&guncon2->intf->dev, "failed to save calibration for %s\n", guncon2->cal_key);
+    mutex_unlock(&guncon2_cal_mutex);
+}
+
+static ssize_t calibration_key_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%s\n", guncon2->cal_key);
+}
+static DEVICE_ATTR_RO(calibration_key);
+
+/* Jitter filter switch and tuning */
+static ssize_t filter_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%d\n", guncon2_param(guncon2, filter_enabled));
+}
+
+static ssize_t filter_store(struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    bool enable;
+    int error;
+
+    error = kstrtobool(buf, &enable);
+    if (error)
+        return error;
+
+    error = guncon2_param_set(guncon2, filter_enabled, enable);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(filter);
+
+static ssize_t filter_min_cutoff_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, filter_min_cutoff));
+}
+
+static ssize_t filter_min_cutoff_store(struct device *dev, struct device_attribute *attr,
+                                       const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 cutoff;
+    int error;
+
+    error = kstrtou32(buf, 10, &cutoff);
+    if (error)
+        return error;
+    if (!cutoff)
+        return -EINVAL;
+
+    error = guncon2_param_set(guncon2, filter_min_cutoff, cutoff);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(filter_min_cutoff);
 
-// default calibration, can be updated with evdev-joystick
-#define X_MIN 175
-#define X_MAX 720
-#define Y_MIN 20
-#define Y_MAX 240
+static ssize_t filter_beta_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
 
-struct guncon2 {
-    struct input_dev *input_device;
-    struct usb_interface *intf;
-    struct urb *urb;
-    struct mutex pm_mutex;
-    bool is_open;
-    char phys[64];
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, filter_beta));
+}
+
+static ssize_t filter_beta_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 beta;
+    int error;
+
+    error = kstrtou32(buf, 10, &beta);
+    if (error)
+        return error;
+
+    error = guncon2_param_set(guncon2, filter_beta, beta);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(filter_beta);
+
+/* Coalescing window in microseconds, 0 sends every change straight away */
+static ssize_t coalesce_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, coalesce_us));
+}
+
+static ssize_t coalesce_us_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 window;
+    int error;
+
+    error = kstrtou32(buf, 10, &window);
+    if (error)
+        return error;
+    if (window > GUNCON2_COALESCE_MAX_US)
+        return -EINVAL;
+
+    error = guncon2_param_set(guncon2, coalesce_us, window);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(coalesce_us);
+
+/* Number of samples that end a coalescing window early, 0 for no limit */
+static ssize_t coalesce_samples_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, coalesce_samples));
+}
+
+static ssize_t coalesce_samples_store(struct device *dev, struct device_attribute *attr,
+                                      const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 samples;
+    int error;
+
+    error = kstrtou32(buf, 10, &samples);
+    if (error)
+        return error;
+
+    error = guncon2_param_set(guncon2, coalesce_samples, samples);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(coalesce_samples);
+
+/* Time either side of a trigger pull searched for an on-screen position, in microseconds */
+static ssize_t shot_window_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, shot_window_us));
+}
+
+static ssize_t shot_window_us_store(struct device *dev, struct device_attribute *attr,
+                                    const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 window;
+    int error;
+
+    error = kstrtou32(buf, 10, &window);
+    if (error)
+        return error;
+    if (window > GUNCON2_SHOT_WINDOW_MAX_US)
+        return -EINVAL;
+
+    error = guncon2_param_set(guncon2, shot_window_us, window);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(shot_window_us);
+
+/* Prediction look-ahead in microseconds, 0 turns prediction off */
+static ssize_t predict_us_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", guncon2_param(guncon2, predict_us));
+}
+
+static ssize_t predict_us_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    u32 lookahead;
+    int error;
+
+    error = kstrtou32(buf, 10, &lookahead);
+    if (error)
+        return error;
+    if (lookahead > GUNCON2_PREDICT_MAX_US)
+        return -EINVAL;
+
+    error = guncon2_param_set(guncon2, predict_us, lookahead);
+    return error ?: count;
+}
+static DEVICE_ATTR_RW(predict_us);
+
+/*
+ * Latest sample as "timestamp x y raw_x raw_y buttons offscreen", read
+ * without a lock so polling it does not hold up the completion handler.
+ */
+static ssize_t current_state_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+    struct guncon2_sample sample;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&guncon2->latest_seq);
+        sample = guncon2->latest;
+    } while (read_seqcount_retry(&guncon2->latest_seq, seq));
+
+    return sysfs_emit(buf, "%llu %u %u %u %u 0x%04x %d\n", sample.timestamp, sample.x, sample.y,
+                      sample.raw_x, sample.raw_y, sample.buttons, !!(sample.flags & GUNCON2_SAMPLE_OFFSCREEN));
+}
+static DEVICE_ATTR_RO(current_state);
+
+/* Polling interval of the interrupt URBs in microseconds, as submitted */
+static ssize_t interval_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(guncon2->interval_us));
+}
+static DEVICE_ATTR_RO(interval);
+
+/* Reports received over the last second, as measured by the completion handler */
+static ssize_t report_rate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct guncon2 *guncon2 = usb_get_intfdata(to_usb_interface(dev));
+
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&guncon2->stats.packets_per_sec));
+}
+static DEVICE_ATTR_RO(report_rate);
+
+static struct attribute *guncon2_attrs[] = {
+        &dev_attr_refresh_rate.attr,
+        &dev_attr_interlace.attr,
+        &dev_attr_x_offset.attr,
+        &dev_attr_y_offset.attr,
+        &dev_attr_calibration_matrix.attr,
+        &dev_attr_calibration_key.attr,
+        &dev_attr_filter.attr,
+        &dev_attr_filter_min_cutoff.attr,
+        &dev_attr_filter_beta.attr,
+        &dev_attr_coalesce_us.attr,
+        &dev_attr_coalesce_samples.attr,
+        &dev_attr_shot_window_us.attr,
+        &dev_attr_predict_us.attr,
+        &dev_attr_current_state.attr,
+        &dev_attr_interval.attr,
+        &dev_attr_report_rate.attr,
+        NULL,
 };
 
-struct gc_mode {
-    unsigned short a;
-    unsigned char b;
-    unsigned char c;
-    unsigned char d;
-    unsigned char mode;
+static const struct attribute_group guncon2_group = {
+        .attrs = guncon2_attrs,
 };
 
-static void guncon2_usb_irq(struct urb *urb) {
-    struct guncon2 *guncon2 = urb->context;
-    unsigned char *data = urb->transfer_buffer;
-    int error, buttons;
-    unsigned short x, y;
-    signed char hat_x = 0;
-    signed char hat_y = 0;
+static void guncon2_quality_read(struct guncon2 *guncon2, struct guncon2_quality *q) {
+    unsigned int seq;
 
-    switch (urb->status) {
-        case 0:
-            /* success */
-            break;
-        case -ETIME:
-            /* this urb is timing out */
-            dev_dbg(&guncon2->intf->dev,
-                    "%s - urb timed out - was the device unplugged?\n",
-                    __func__);
-            return;
-        case -ECONNRESET:
-        case -ENOENT:
-        case -ESHUTDOWN:
-        case -EPIPE:
-            /* this urb is terminated, clean up */
-            dev_dbg(&guncon2->intf->dev, "%s - urb shutting down with status: %d\n",
-                    __func__, urb->status);
-            return;
-        default:
-            dev_dbg(&guncon2->intf->dev, "%s - nonzero urb status received: %d\n",
-                    __func__, urb->status);
-            goto exit;
-    }
+    do {
+        seq = read_seqcount_begin(&guncon2->quality_seq);
+        *q = guncon2->quality;
+    } while (read_seqcount_retry(&guncon2->quality_seq, seq));
+}
 
-    if (urb->actual_length == 6) {
-        /* Aiming */
-        x = (data[3] << 8) | data[2];
-        y = data[4];
+/* Q16 to thousandths */
+#define GUNCON2_Q16_MILLI(value) div_s64((s64) (value) * 1000, BIT(GUNCON2_Q16_SHIFT))
+
+#define GUNCON2_QUALITY_ATTR(_name, _fmt, _value)                                                     \
+    static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) {     \
+        struct guncon2_quality q;                                                                   \
+                                                                                                    \
+        guncon2_quality_read(usb_get_intfdata(to_usb_interface(dev)), &q);                         \
+        return sysfs_emit(buf, _fmt "\n", _value);                                                  \
+    }                                                                                               \
+    static DEVICE_ATTR_RO(_name)
+
+/* Aim quality, in the quality group on the USB interface */
+GUNCON2_QUALITY_ATTR(samples, "%llu", q.samples);
+GUNCON2_QUALITY_ATTR(offscreen_samples, "%llu", q.offscreen);
+GUNCON2_QUALITY_ATTR(jumps, "%llu", q.jumps);
+GUNCON2_QUALITY_ATTR(offscreen_ratio, "%lld", GUNCON2_Q16_MILLI(q.offscreen_ratio));
+GUNCON2_QUALITY_ATTR(jump_rate, "%lld", GUNCON2_Q16_MILLI(q.jump_ratio));
+GUNCON2_QUALITY_ATTR(still_mean_x, "%lld", GUNCON2_Q16_MILLI(q.mean[0]));
+GUNCON2_QUALITY_ATTR(still_mean_y, "%lld", GUNCON2_Q16_MILLI(q.mean[1]));
+GUNCON2_QUALITY_ATTR(still_var_x, "%lld", GUNCON2_Q16_MILLI(q.var[0]));
+GUNCON2_QUALITY_ATTR(still_var_y, "%lld", GUNCON2_Q16_MILLI(q.var[1]));
+
+static struct attribute *guncon2_quality_attrs[] = {
+        &dev_attr_samples.attr,
+        &dev_attr_offscreen_samples.attr,
+        &dev_attr_jumps.attr,
+        &dev_attr_offscreen_ratio.attr,
+        &dev_attr_jump_rate.attr,
+        &dev_attr_still_mean_x.attr,
+        &dev_attr_still_mean_y.attr,
+        &dev_attr_still_var_x.attr,
+        &dev_attr_still_var_y.attr,
+        NULL,
+};
 
-        input_report_abs(guncon2->input_device, ABS_X, x);
-        input_report_abs(guncon2->input_device, ABS_Y, y);
+static const struct attribute_group guncon2_quality_group = {
+        .name = "quality",
+        .attrs = guncon2_quality_attrs,
+};
 
-        /* Buttons */
-        buttons = ((data[0] << 8) | data[1]) ^ 0xffff;
+static const struct attribute_group *guncon2_groups[] = {
+        &guncon2_group,
+        &guncon2_quality_group,
+        NULL,
+};
 
-        // d-pad
-        if (buttons & GUNCON2_DPAD_LEFT) {// left
-            hat_x -= 1;
-        }
-        if (buttons & GUNCON2_DPAD_RIGHT) {// right
-            hat_x += 1;
-        }
-        if (buttons & GUNCON2_DPAD_UP) {// up
-            hat_y -= 1;
-        }
-        if (buttons & GUNCON2_DPAD_DOWN) {// down
-            hat_y += 1;
-        }
-        input_report_abs(guncon2->input_device, ABS_HAT0X, hat_x);
-        input_report_abs(guncon2->input_device, ABS_HAT0Y, hat_y);
+static int guncon2_stats_show(struct seq_file *m, void *unused) {
+    struct guncon2 *guncon2 = m->private;
+    struct guncon2_stats *stats = &guncon2->stats;
+
+    seq_printf(m, "completions: %ld\n", atomic_long_read(&stats->completions));
+    seq_printf(m, "status_ok: %ld\n", atomic_long_read(&stats->status_ok));
+    seq_printf(m, "status_etime: %ld\n", atomic_long_read(&stats->status_etime));
+    seq_printf(m, "status_econnreset: %ld\n", atomic_long_read(&stats->status_econnreset));
+    seq_printf(m, "status_enoent: %ld\n", atomic_long_read(&stats->status_enoent));
+    seq_printf(m, "status_eshutdown: %ld\n", atomic_long_read(&stats->status_eshutdown));
+    seq_printf(m, "status_epipe: %ld\n", atomic_long_read(&stats->status_epipe));
+    seq_printf(m, "status_other: %ld\n", atomic_long_read(&stats->status_other));
+    seq_printf(m, "short_reads: %ld\n", atomic_long_read(&stats->short_reads));
+    seq_printf(m, "resubmit_failures: %ld\n", atomic_long_read(&stats->resubmit_failures));
+    seq_printf(m, "backoffs: %ld\n", atomic_long_read(&stats->backoffs));
+    seq_printf(m, "mode_errors: %ld\n", atomic_long_read(&stats->mode_errors));
+    seq_printf(m, "recoil_errors: %ld\n", atomic_long_read(&stats->recoil_errors));
+    seq_printf(m, "packets_per_sec: %ld\n", atomic_long_read(&stats->packets_per_sec));
 
-        // main buttons
-        input_report_key(guncon2->input_device, BTN_LEFT, buttons & GUNCON2_TRIGGER);
-        input_report_key(guncon2->input_device, BTN_RIGHT, buttons & GUNCON2_BTN_A || buttons & GUNCON2_BTN_C);
-        input_report_key(guncon2->input_device, BTN_MIDDLE, buttons & GUNCON2_BTN_B);
-        input_report_key(guncon2->input_device, BTN_A, buttons & GUNCON2_BTN_A);
-        input_report_key(guncon2->input_device, BTN_B, buttons & GUNCON2_BTN_B);
-        input_report_key(guncon2->input_device, BTN_C, buttons & GUNCON2_BTN_C);
-        input_report_key(guncon2->input_device, BTN_START, buttons & GUNCON2_BTN_START);
-        input_report_key(guncon2->input_device, BTN_SELECT, buttons & GUNCON2_BTN_SELECT);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(guncon2_stats);
 
-        input_sync(guncon2->input_device);
-    }
+static int guncon2_probe_timing_show(struct seq_file *m, void *unused) {
+    struct guncon2 *guncon2 = m->private;
 
-exit:
-    /* Resubmit to fetch new fresh URBs */
-    error = usb_submit_urb(urb, GFP_ATOMIC);
-    if (error && error != -EPERM)
-        dev_err(&guncon2->intf->dev,
-                "%s - usb_submit_urb failed with result: %d",
-                __func__, error);
+    seq_printf(m, "registered_us: %lld\n", div_s64(READ_ONCE(guncon2->registered_ns), NSEC_PER_USEC));
+    seq_printf(m, "first_report_us: %lld\n", div_s64(READ_ONCE(guncon2->first_report_ns), NSEC_PER_USEC));
+    seq_printf(m, "first_event_us: %lld\n", div_s64(READ_ONCE(guncon2->first_event_ns), NSEC_PER_USEC));
+
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(guncon2_probe_timing);
 
-static int guncon2_open(struct input_dev *input) {
-    unsigned char *gmode;
-    struct guncon2 *guncon2 = input_get_drvdata(input);
-    struct usb_device *usb_dev = interface_to_usbdev(guncon2->intf);
-    int retval;
-    mutex_lock(&guncon2->pm_mutex);
+static void guncon2_show_hist(struct seq_file *m, atomic_long_t *hist, const char *unit) {
+    unsigned int i;
 
-    gmode = kzalloc(6, GFP_KERNEL);
-    if (!gmode)
-        return -ENOMEM;
+    seq_printf(m, "%10u %-10u %s: %ld\n", 0, 0, unit, atomic_long_read(&hist[0]));
+    for (i = 1; i < GUNCON2_HIST_BUCKETS - 1; i++)
+        seq_printf(m, "%10lu %-10lu %s: %ld\n", BIT(i - 1), BIT(i) - 1, unit,
+                   atomic_long_read(&hist[i]));
+    seq_printf(m, "%10lu %-10s %s: %ld\n", BIT(i - 1), "+", unit, atomic_long_read(&hist[i]));
+}
 
-    /* set the mode to normal 50Hz mode */
-    gmode[5] = 1;
-    usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0),
-                    0x09, 0x21, 0x200, 0, gmode, 6, 100000);
+static int guncon2_interval_hist_show(struct seq_file *m, void *unused) {
+    struct guncon2 *guncon2 = m->private;
 
-    kfree(gmode);
+    guncon2_show_hist(m, guncon2->stats.interval_hist, "us");
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(guncon2_interval_hist);
 
-    retval = usb_submit_urb(guncon2->urb, GFP_KERNEL);
-    if (retval) {
-        dev_err(&guncon2->intf->dev,
-                "%s - usb_submit_urb failed, error: %d\n",
-                __func__, retval);
-        retval = -EIO;
-        goto out;
-    }
+static int guncon2_process_hist_show(struct seq_file *m, void *unused) {
+    struct guncon2 *guncon2 = m->private;
 
-    guncon2->is_open = true;
+    guncon2_show_hist(m, guncon2->stats.process_hist, "ns");
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(guncon2_process_hist);
 
-out:
-    mutex_unlock(&guncon2->pm_mutex);
-    return retval;
+static void guncon2_remove_debugfs(void *context) {
+    struct guncon2 *guncon2 = context;
+
+    debugfs_remove_recursive(guncon2->debugfs_dir);
 }
 
-static void guncon2_close(struct input_dev *input) {
-    struct guncon2 *guncon2 = input_get_drvdata(input);
-    mutex_lock(&guncon2->pm_mutex);
-    usb_kill_urb(guncon2->urb);
-    guncon2->is_open = false;
-    mutex_unlock(&guncon2->pm_mutex);
+static int guncon2_create_debugfs(struct guncon2 *guncon2) {
+    struct dentry *dir;
+
+    dir = debugfs_create_dir(dev_name(&guncon2->intf->dev), guncon2_debugfs_root);
+    debugfs_create_file("stats", 0444, dir, guncon2, &guncon2_stats_fops);
+    debugfs_create_file("interval_histogram", 0444, dir, guncon2, &guncon2_interval_hist_fops);
+    debugfs_create_file("process_histogram", 0444, dir, guncon2, &guncon2_process_hist_fops);
+    debugfs_create_file("probe_timing", 0444, dir, guncon2, &guncon2_probe_timing_fops);
+    guncon2->debugfs_dir = dir;
+
+    return devm_add_action_or_reset(&guncon2->intf->dev, guncon2_remove_debugfs, guncon2);
 }
 
-static void guncon2_free_urb(void *context) {
+static void guncon2_free_urbs(void *context) {
     struct guncon2 *guncon2 = context;
+    struct urb *urb;
+    unsigned int i;
+
+    cancel_delayed_work_sync(&guncon2->resubmit_work);
+
+    if (guncon2->mode_urb) {
+        usb_kill_urb(guncon2->mode_urb);
+        cancel_delayed_work_sync(&guncon2->mode_timeout);
+        usb_free_urb(guncon2->mode_urb);
+    }
+
+    usb_kill_anchored_urbs(&guncon2->recoil_submitted);
+    for (i = 0; i < GUNCON2_RECOIL_URBS; i++)
+        usb_free_urb(guncon2->recoil_urbs[i]);
+
+    for (i = 0; i < guncon2->num_urbs; i++) {
+        urb = guncon2->urbs[i];
+        usb_free_coherent(urb->dev, guncon2->xfer_size,
+                          urb->transfer_buffer, urb->transfer_dma);
+        usb_free_urb(urb);
+    }
+}
+
+/*
+ * Polling interval for usb_fill_int_urb(), in frames for low and full speed
+ * and as a bInterval style exponent of microframes otherwise. The interval
+ * parameter is in ms for all speeds, usb_submit_urb() rounds it down to a
+ * power of two and xHCI replaces it with the interval of the endpoint.
+ */
+static int guncon2_urb_interval(struct usb_device *udev, struct usb_endpoint_descriptor *epirq) {
+    unsigned int ms = READ_ONCE(interval);
+
+    if (!ms)
+        return epirq->bInterval;
+
+    if (udev->speed == USB_SPEED_LOW || udev->speed == USB_SPEED_FULL)
+        return clamp_t(unsigned int, ms, 1, 255);
+
+    return clamp_t(unsigned int, ilog2(ms * 8) + 1, 1, 16);
+}
 
-    usb_free_urb(guncon2->urb);
+static int guncon2_alloc_urbs(struct guncon2 *guncon2, struct usb_device *udev,
+                              struct usb_endpoint_descriptor *epirq) {
+    unsigned int count = clamp_t(unsigned int, urb_count, GUNCON2_MIN_URBS, GUNCON2_MAX_URBS);
+    int urb_interval = guncon2_urb_interval(udev, epirq);
+    struct urb *urb;
+    void *xfer_buf;
+    unsigned int i;
+
+    guncon2->xfer_size = usb_endpoint_maxp(epirq);
+
+    while (guncon2->num_urbs < count) {
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb)
+            return -ENOMEM;
+
+        xfer_buf = usb_alloc_coherent(udev, guncon2->xfer_size, GFP_KERNEL,
+                                      &urb->transfer_dma);
+        if (!xfer_buf) {
+            usb_free_urb(urb);
+            return -ENOMEM;
+        }
+
+        /* set to URB for the interrupt interface  */
+        usb_fill_int_urb(urb, udev,
+                         usb_rcvintpipe(udev, epirq->bEndpointAddress),
+                         xfer_buf, guncon2->xfer_size, guncon2->model->complete, guncon2, urb_interval);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+        guncon2->urbs[guncon2->num_urbs++] = urb;
+    }
+
+    /* SET_REPORT(output, report 0) carrying the sampling mode */
+    guncon2->mode_msg = devm_kzalloc(&guncon2->intf->dev, sizeof(*guncon2->mode_msg), GFP_KERNEL);
+    if (!guncon2->mode_msg)
+        return -ENOMEM;
+
+    guncon2->mode_msg->req.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    guncon2->mode_msg->req.bRequest = 0x09;
+    guncon2->mode_msg->req.wValue = cpu_to_le16(0x200);
+    guncon2->mode_msg->req.wIndex = 0;
+    guncon2->mode_msg->req.wLength = cpu_to_le16(sizeof(guncon2->mode_msg->mode));
+
+    guncon2->mode_urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!guncon2->mode_urb)
+        return -ENOMEM;
+
+    usb_fill_control_urb(guncon2->mode_urb, udev, usb_sndctrlpipe(udev, 0),
+                         (unsigned char *)&guncon2->mode_msg->req, &guncon2->mode_msg->mode,
+                         sizeof(guncon2->mode_msg->mode), guncon2_mode_complete, guncon2);
+
+    if (!recoil)
+        return 0;
+
+    guncon2->recoil_msgs = devm_kcalloc(&guncon2->intf->dev, GUNCON2_RECOIL_URBS, sizeof(*guncon2->recoil_msgs),
+                                        GFP_KERNEL);
+    if (!guncon2->recoil_msgs)
+        return -ENOMEM;
+
+    for (i = 0; i < GUNCON2_RECOIL_URBS; i++) {
+        struct guncon2_recoil_msg *msg = &guncon2->recoil_msgs[i];
+
+        msg->req.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+        msg->req.bRequest = 0x09;
+        msg->req.wValue = cpu_to_le16(0x201);
+        msg->req.wIndex = 0;
+        msg->req.wLength = cpu_to_le16(sizeof(msg->strength));
+
+        guncon2->recoil_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!guncon2->recoil_urbs[i])
+            return -ENOMEM;
+
+        usb_fill_control_urb(guncon2->recoil_urbs[i], udev, usb_sndctrlpipe(udev, 0),
+                             (unsigned char *)&msg->req, &msg->strength, sizeof(msg->strength),
+                             guncon2_recoil_complete, guncon2);
+        __set_bit(i, &guncon2->recoil_idle);
+    }
+
+    return 0;
 }
 
 static int guncon2_probe(struct usb_interface *intf,
                          const struct usb_device_id *id) {
     struct usb_device *udev = interface_to_usbdev(intf);
     struct guncon2 *guncon2;
+    struct guncon2_params *params;
     struct usb_endpoint_descriptor *epirq;
-    size_t xfer_size;
-    void *xfer_buf;
+    ktime_t probe_time = ktime_get();
     int error;
 
     /*
@@ -203,36 +3025,91 @@ static int guncon2_probe(struct usb_interface *intf,
         return error;
     }
 
+    if (id->driver_info >= ARRAY_SIZE(guncon2_models))
+        return -ENODEV;
+
+    if (usb_endpoint_maxp(epirq) < guncon2_models[id->driver_info].report_len) {
+        dev_err(&intf->dev, "Interrupt endpoint too small for the reports\n");
+        return -ENODEV;
+    }
+
     /* Allocate memory for the guncon2 struct using devm */
     guncon2 = devm_kzalloc(&intf->dev, sizeof(*guncon2), GFP_KERNEL);
     if (!guncon2)
         return -ENOMEM;
 
     mutex_init(&guncon2->pm_mutex);
+    mutex_init(&guncon2->params_lock);
+    seqcount_init(&guncon2->latest_seq);
+    seqcount_init(&guncon2->quality_seq);
+    init_usb_anchor(&guncon2->submitted);
+    init_usb_anchor(&guncon2->deferred);
+    INIT_DELAYED_WORK(&guncon2->resubmit_work, guncon2_resubmit_work);
+    spin_lock_init(&guncon2->mode_lock);
+    INIT_DELAYED_WORK(&guncon2->mode_timeout, guncon2_mode_timeout);
+    spin_lock_init(&guncon2->report_lock);
+    init_usb_anchor(&guncon2->recoil_submitted);
+    spin_lock_init(&guncon2->recoil_lock);
+    hrtimer_setup(&guncon2->coalesce_timer, guncon2_coalesce_expired, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     guncon2->intf = intf;
+    guncon2->model = &guncon2_models[id->driver_info];
+    guncon2->agg_slot = -1;
+    guncon2->probe_time = probe_time;
+
+    /* initial sampling mode from the module parameters */
+    if (refresh_rate != 60)
+        guncon2->mode.mode |= GUNCON2_MODE_50HZ;
+    if (interlace)
+        guncon2->mode.mode |= GUNCON2_MODE_INTERLACE;
+    guncon2->mode.x_offset = cpu_to_le16(x_offset);
+    guncon2->mode.y_offset = y_offset;
+
+    params = kzalloc(sizeof(*params), GFP_KERNEL);
+    if (!params)
+        return -ENOMEM;
+    params->filter_min_cutoff = GUNCON2_FILTER_MIN_CUTOFF;
+    params->filter_beta = GUNCON2_FILTER_BETA;
+    params->shot_window_us = GUNCON2_SHOT_WINDOW_US;
+    RCU_INIT_POINTER(guncon2->params, params);
 
-    usb_set_intfdata(guncon2->intf, guncon2);
+    error = devm_add_action_or_reset(&intf->dev, guncon2_free_params, guncon2);
+    if (error)
+        return error;
 
-    xfer_size = usb_endpoint_maxp(epirq);
-    xfer_buf = devm_kmalloc(&intf->dev, xfer_size, GFP_KERNEL);
-    if (!xfer_buf)
-        return -ENOMEM;
+    usb_set_intfdata(guncon2->intf, guncon2);
+    pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_delay);
 
-    guncon2->urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!guncon2->urb)
-        return -ENOMEM;
+    error = guncon2_alloc_urbs(guncon2, udev, epirq);
+    if (error) {
+        /* release whatever part of the pool was allocated */
+        guncon2_free_urbs(guncon2);
+        return error;
+    }
 
-    error = devm_add_action_or_reset(&intf->dev, guncon2_free_urb, guncon2);
+    error = devm_add_action_or_reset(&intf->dev, guncon2_free_urbs, guncon2);
     if (error)
         return error;
 
-    /* set to URB for the interrupt interface  */
-    usb_fill_int_urb(guncon2->urb, udev,
-                     usb_rcvintpipe(udev, epirq->bEndpointAddress),
-                     xfer_buf, xfer_size, guncon2_usb_irq, guncon2, 1);
+    /*
+     * The ring is torn down after the input device is freed. An open ring
+     * keeps the URBs running until then, the coalesce timer they can arm is
+     * stopped by guncon2_coalesce_stop before the input device goes.
+     */
+    if (enable_ring) {
+        error = guncon2_ring_create(guncon2);
+        if (error)
+            return error;
+    }
 
     /* get path tree for the usb device */
     usb_make_path(udev, guncon2->phys, sizeof(guncon2->phys));
+
+    /* calibration is stored by serial number, or by the path if there isn't one */
+    if (udev->serial && *udev->serial)
+        strscpy(guncon2->cal_key, udev->serial, sizeof(guncon2->cal_key));
+    else
+        strscpy(guncon2->cal_key, guncon2->phys, sizeof(guncon2->cal_key));
+
     strlcat(guncon2->phys, "/input0", sizeof(guncon2->phys));
 
     /* Button related */
@@ -242,7 +3119,11 @@ static int guncon2_probe(struct usb_interface *intf,
         return -ENOMEM;
     }
 
-    guncon2->input_device->name = "Namco GunCon 2";
+    error = devm_add_action_or_reset(&intf->dev, guncon2_coalesce_stop, guncon2);
+    if (error)
+        return error;
+
+    guncon2->input_device->name = guncon2->model->name;
     guncon2->input_device->phys = guncon2->phys;
 
     guncon2->input_device->open = guncon2_open;
@@ -259,6 +3140,18 @@ static int guncon2_probe(struct usb_interface *intf,
     input_set_abs_params(guncon2->input_device, ABS_X, X_MIN, X_MAX, 0, 0);
     input_set_abs_params(guncon2->input_device, ABS_Y, Y_MIN, Y_MAX, 0, 0);
 
+    // off-screen, 1 while the gun can't see the screen
+    input_set_abs_params(guncon2->input_device, ABS_DISTANCE, 0, 1, 0, 0);
+
+    /* a stored calibration replaces the defaults, so the first report is already calibrated */
+    error = guncon2_attach_cal(guncon2);
+    if (error)
+        return error;
+
+    error = devm_add_action_or_reset(&intf->dev, guncon2_detach_cal, guncon2);
+    if (error)
+        return error;
+
     input_set_capability(guncon2->input_device, EV_KEY, BTN_A);
     input_set_capability(guncon2->input_device, EV_KEY, BTN_B);
     input_set_capability(guncon2->input_device, EV_KEY, BTN_C);
@@ -271,41 +3164,110 @@ static int guncon2_probe(struct usb_interface *intf,
     input_set_abs_params(guncon2->input_device, ABS_HAT0X, -1, 1, 0, 0);
     input_set_abs_params(guncon2->input_device, ABS_HAT0Y, -1, 1, 0, 0);
 
+    // per-sample USB frame timestamps
+    input_set_capability(guncon2->input_device, EV_MSC, MSC_TIMESTAMP);
+    // latched shot position, x << 16 | y
+    input_set_capability(guncon2->input_device, EV_MSC, MSC_RAW);
+
     input_set_drvdata(guncon2->input_device, guncon2);
 
+    if (recoil) {
+        input_set_capability(guncon2->input_device, EV_FF, FF_RUMBLE);
+        error = input_ff_create_memless(guncon2->input_device, NULL, guncon2_play_effect);
+        if (error)
+            return error;
+    }
+
+    error = guncon2_create_debugfs(guncon2);
+    if (error)
+        return error;
+
+    if (early_start) {
+        error = guncon2_early_start(guncon2);
+        if (error)
+            return error;
+    }
+
     error = input_register_device(guncon2->input_device);
     if (error)
         return error;
 
+    WRITE_ONCE(guncon2->registered_ns, ktime_to_ns(ktime_sub(ktime_get(), guncon2->probe_time)));
+    WRITE_ONCE(guncon2->registered, true);
+
+    error = guncon2_ring_register(guncon2);
+    if (error)
+        return error;
+
+    error = guncon2_agg_add(guncon2);
+    if (error)
+        return error;
+
     return 0;
 }
 
 static void guncon2_disconnect(struct usb_interface *intf) {
-    /* All driver resources are devm-managed. */
+    struct guncon2 *guncon2 = usb_get_intfdata(intf);
+
+    guncon2_save_cal(guncon2);
+
+    /* All other driver resources are devm-managed. */
 }
 
 static int guncon2_suspend(struct usb_interface *intf, pm_message_t message) {
     struct guncon2 *guncon2 = usb_get_intfdata(intf);
 
+    /* recoil played from now on is held back until the resume */
+    spin_lock_irq(&guncon2->recoil_lock);
+    guncon2->recoil_suspended = true;
+    spin_unlock_irq(&guncon2->recoil_lock);
+
     mutex_lock(&guncon2->pm_mutex);
     if (guncon2->is_open) {
-        usb_kill_urb(guncon2->urb);
+        guncon2_kill_urbs(guncon2);
     }
     mutex_unlock(&guncon2->pm_mutex);
 
+    /* only a system suspend gets here with recoil in flight */
+    usb_kill_anchored_urbs(&guncon2->recoil_submitted);
+
     return 0;
 }
 
+/* Send the recoil played while the gun was suspended */
+static void guncon2_recoil_resume(struct guncon2 *guncon2) {
+    bool wake;
+
+    spin_lock_irq(&guncon2->recoil_lock);
+    guncon2->recoil_suspended = false;
+    if (guncon2->recoil_pending)
+        guncon2_recoil_submit(guncon2, guncon2->recoil_next);
+    wake = guncon2->recoil_wake;
+    guncon2->recoil_wake = false;
+    spin_unlock_irq(&guncon2->recoil_lock);
+
+    if (wake)
+        usb_autopm_put_interface_async(guncon2->intf);
+}
+
 static int guncon2_resume(struct usb_interface *intf) {
     struct guncon2 *guncon2 = usb_get_intfdata(intf);
     int retval = 0;
 
     mutex_lock(&guncon2->pm_mutex);
-    if (guncon2->is_open && usb_submit_urb(guncon2->urb, GFP_KERNEL) < 0) {
-        retval = -EIO;
+    if (guncon2->is_open) {
+        /* positions from before the suspend are stale */
+        guncon2->filter.primed = false;
+        guncon2->predictor.primed = false;
+        /* a reset or a mode change killed by the suspend lost the mode */
+        guncon2_send_mode(guncon2);
+        if (guncon2_submit_urbs(guncon2, GFP_KERNEL) < 0)
+            retval = -EIO;
     }
 
     mutex_unlock(&guncon2->pm_mutex);
+
+    guncon2_recoil_resume(guncon2);
     return retval;
 }
 
@@ -313,7 +3275,7 @@ static int guncon2_pre_reset(struct usb_interface *intf) {
     struct guncon2 *guncon2 = usb_get_intfdata(intf);
 
     mutex_lock(&guncon2->pm_mutex);
-    usb_kill_urb(guncon2->urb);
+    guncon2_kill_urbs(guncon2);
     return 0;
 }
 
@@ -321,8 +3283,11 @@ static int guncon2_post_reset(struct usb_interface *intf) {
     struct guncon2 *guncon2 = usb_get_intfdata(intf);
     int retval = 0;
 
-    if (guncon2->is_open && usb_submit_urb(guncon2->urb, GFP_KERNEL) < 0) {
-        retval = -EIO;
+    if (guncon2->is_open) {
+        /* the reset dropped the sampling mode */
+        guncon2_send_mode(guncon2);
+        if (guncon2_submit_urbs(guncon2, GFP_KERNEL) < 0)
+            retval = -EIO;
     }
 
     mutex_unlock(&guncon2->pm_mutex);
@@ -335,7 +3300,7 @@ static int guncon2_reset_resume(struct usb_interface *intf) {
 }
 
 static const struct usb_device_id guncon2_table[] = {
-        {USB_DEVICE(NAMCO_VENDOR_ID, GUNCON2_PRODUCT_ID)},
+        {USB_DEVICE(NAMCO_VENDOR_ID, GUNCON2_PRODUCT_ID), .driver_info = GUNCON2_MODEL_GUNCON2},
         {}};
 
 MODULE_DEVICE_TABLE(usb, guncon2_table);
@@ -350,9 +3315,45 @@ static struct usb_driver guncon2_driver = {
         .pre_reset = guncon2_pre_reset,
         .post_reset = guncon2_post_reset,
         .reset_resume = guncon2_reset_resume,
+        .dev_groups = guncon2_groups,
+        .supports_autosuspend = 1,
 };
 
-module_usb_driver(guncon2_driver);
+static int __init guncon2_init(void) {
+    int error;
+
+    guncon2_debugfs_root = debugfs_create_dir("guncon2", NULL);
+
+    if (enable_aggregate) {
+        error = misc_register(&guncon2_agg_misc);
+        if (error)
+            goto err_debugfs;
+    }
+
+    error = usb_register(&guncon2_driver);
+    if (error)
+        goto err_aggregate;
+
+    return 0;
+
+err_aggregate:
+    if (enable_aggregate)
+        misc_deregister(&guncon2_agg_misc);
+err_debugfs:
+    debugfs_remove_recursive(guncon2_debugfs_root);
+    return error;
+}
+
+static void __exit guncon2_exit(void) {
+    usb_deregister(&guncon2_driver);
+    if (enable_aggregate)
+        misc_deregister(&guncon2_agg_misc);
+    debugfs_remove_recursive(guncon2_debugfs_root);
+    guncon2_clear_cal();
+}
+
+module_init(guncon2_init);
+module_exit(guncon2_exit);
 
 MODULE_AUTHOR("beardypig <beardypig@protonmail.com>");
 MODULE_DESCRIPTION("Namco GunCon 2");
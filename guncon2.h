@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace interface for the Namco GunCon 2 USB light gun driver
+ * Copyright (C) 2019-2021 beardypig <beardypig@protonmail.com>
+ */
+#ifndef _GUNCON2_H
+#define _GUNCON2_H
+
+#include <linux/types.h>
+
+/* button bits, as reported by the gun (active high) */
+#define GUNCON2_DPAD_LEFT (1 << 15)
+#define GUNCON2_DPAD_RIGHT (1 << 13)
+#define GUNCON2_DPAD_UP (1 << 12)
+#define GUNCON2_DPAD_DOWN (1 << 14)
+#define GUNCON2_TRIGGER (1 << 5)
+#define GUNCON2_BTN_A (1 << 11)
+#define GUNCON2_BTN_B (1 << 10)
+#define GUNCON2_BTN_C (1 << 9)
+#define GUNCON2_BTN_START (1 << 7)
+#define GUNCON2_BTN_SELECT (1 << 6)
+
+/*
+ * Sample ring, mapped from /dev/guncon2-N. The first page holds the header,
+ * the entries start at data_offset. The driver is the only producer and
+ * advances head after an entry is written, the consumer advances tail once
+ * it is done with an entry. Both count entries and wrap at 2^32, the slot of
+ * an entry is its index modulo the number of entries.
+ *
+ * The entries can also be read() instead, which advances tail, and a write()
+ * of a 6-byte mode report (as sent to the gun with SET_REPORT) sets the
+ * sampling mode.
+ */
+#define GUNCON2_RING_VERSION 3
+
+/* longest report kept in a sample */
+#define GUNCON2_SAMPLE_DATA_LEN 8
+
+/* sample flags */
+#define GUNCON2_SAMPLE_OFFSCREEN (1 << 0)
+#define GUNCON2_SAMPLE_SHOT (1 << 1) /* an extra entry with the position latched for a trigger pull */
+
+struct guncon2_sample {
+    __u64 timestamp; /* CLOCK_MONOTONIC time of the URB completion, in ns */
+    __u32 msc_timestamp; /* MSC_TIMESTAMP value of the sample, in us */
+    __u16 x, y; /* position as reported on ABS_X/ABS_Y */
+    __u16 raw_x, raw_y; /* position as sent by the gun */
+    __u16 buttons; /* GUNCON2_* button bits */
+    __u16 flags; /* GUNCON2_SAMPLE_* flags */
+    __u16 predict_x, predict_y; /* x/y extrapolated by predict_us, the same as x/y while prediction is off */
+    __u8 data_len; /* length of the report */
+    __u8 reserved[3];
+    __u8 data[GUNCON2_SAMPLE_DATA_LEN]; /* the report as received from the gun */
+};
+
+struct guncon2_ring_header {
+    __u32 version;
+    __u32 entries; /* number of entries, a power of two */
+    __u32 entry_size;
+    __u32 data_offset;
+    __u32 pad0[12];
+
+    /* written by the driver */
+    __u32 head;
+    __u32 dropped; /* samples dropped because the ring was full */
+    __u32 pad1[14];
+
+    /* written by the consumer */
+    __u32 tail;
+    __u32 pad2[15];
+};
+
+/*
+ * Aggregate device, /dev/guncon2-aggregate. Each read() returns the latest
+ * struct guncon2_frame, blocking until a frame newer than the last one read
+ * has been published. A frame is published once every connected gun has
+ * reported in it, or when a gun reports in a later frame.
+ */
+#define GUNCON2_AGG_MAX_GUNS 4
+
+/* gun state flags, in addition to the GUNCON2_SAMPLE_* flags */
+#define GUNCON2_GUN_CONNECTED (1 << 14)
+#define GUNCON2_GUN_UPDATED (1 << 15) /* the gun reported in this frame */
+
+struct guncon2_gun_state {
+    __u16 x, y;
+    __u16 buttons;
+    __u16 flags;
+};
+
+struct guncon2_frame {
+    __u64 timestamp; /* CLOCK_MONOTONIC time of the last sample in the frame, in ns */
+    __u32 frame; /* USB frame number */
+    __u32 sequence; /* incremented for every published frame */
+    struct guncon2_gun_state guns[GUNCON2_AGG_MAX_GUNS];
+};
+
+#endif /* _GUNCON2_H */
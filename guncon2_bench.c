@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Decode path benchmark for the Namco GunCon 2 USB light gun driver
+ * Copyright (C) 2019-2021 beardypig <beardypig@protonmail.com>
+ *
+ * Runs the report decoding, the jitter filter, the screen mapping and the
+ * predictor from guncon2_decode.h over a stream of reports and prints the
+ * time per packet. The reports are replayed from a usbmon text trace, or
+ * generated when no trace is given:
+ *
+ *   sudo cat /sys/kernel/debug/usb/usbmon/3u > guncon2.mon
+ *   ./guncon2_bench guncon2.mon
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guncon2_decode.h"
+
+/* synthetic reports come at the 1ms interrupt interval */
+#define SYNTHETIC_DT 1000
+
+struct packet {
+    unsigned char data[GUNCON2_REPORT_LEN];
+    unsigned int len;
+    u32 dt; // microseconds since the previous packet
+};
+
+struct stream {
+    struct packet *packets;
+    size_t count;
+    size_t size;
+};
+
+static void stream_add(struct stream *stream, const unsigned char *data, unsigned int len, u32 dt) {
+    struct packet *packet;
+
+    if (stream->count == stream->size) {
+        stream->size = stream->size ? stream->size * 2 : 4096;
+        stream->packets = realloc(stream->packets, stream->size * sizeof(*stream->packets));
+        if (!stream->packets) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    packet = &stream->packets[stream->count++];
+    memcpy(packet->data, data, len);
+    packet->len = len;
+    packet->dt = dt;
+}
+
+/*
+ * Read the interrupt IN completions from a usbmon text trace, see
+ * Documentation/usb/usbmon.rst. A completion looks like
+ *
+ *   ffff8880a1b2c300 3575914555 C Ii:3:005:1 0:1 6 = ffff2001 5a00
+ */
+static int stream_load(struct stream *stream, const char *path) {
+    char line[512];
+    unsigned long long last = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        unsigned char data[GUNCON2_REPORT_LEN];
+        unsigned long long timestamp;
+        char type, address[32], status[32];
+        unsigned int len, n = 0;
+        char *words, *word;
+
+        if (sscanf(line, "%*s %llu %c %31s %31s %u", &timestamp, &type, address, status, &len) != 5)
+            continue;
+        if (type != 'C' || strncmp(address, "Ii:", 3) || atoi(status) != 0 || len != GUNCON2_REPORT_LEN)
+            continue;
+
+        words = strchr(line, '=');
+        if (!words)
+            continue;
+
+        /* the data is printed as groups of up to 4 bytes */
+        for (word = strtok(words + 1, " \n"); word && n < len; word = strtok(NULL, " \n")) {
+            for (; word[0] && word[1] && n < len; word += 2) {
+                unsigned int byte;
+
+                if (sscanf(word, "%2x", &byte) != 1)
+                    break;
+                data[n++] = byte;
+            }
+        }
+        if (n != len)
+            continue;
+
+        stream_add(stream, data, len, last ? timestamp - last : SYNTHETIC_DT);
+        last = timestamp;
+    }
+
+    fclose(file);
+
+    if (!stream->count) {
+        fprintf(stderr, "%s: no GunCon 2 reports found\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Generate a gun sweeping across the screen with some sensor noise, going
+ * off-screen and pulling the trigger every so often.
+ */
+static void stream_generate(struct stream *stream, size_t count) {
+    unsigned int seed = 1;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        unsigned char data[GUNCON2_REPORT_LEN];
+        unsigned int x = 175 + (i / 4) % 545;
+        unsigned int y = 20 + (i / 16) % 220;
+        u16 buttons = 0;
+
+        seed = seed * 1103515245 + 12345;
+        x += (seed >> 16) % 3;
+        y += (seed >> 24) % 2;
+
+        if (i % 1000 >= 950)
+            x = 1; // off-screen
+        if (i % 250 < 30)
+            buttons |= GUNCON2_TRIGGER;
+        if (i % 2000 < 100)
+            buttons |= GUNCON2_DPAD_UP | GUNCON2_BTN_A;
+
+        buttons ^= 0xffff;
+        data[0] = buttons >> 8;
+        data[1] = buttons & 0xff;
+        data[2] = x & 0xff;
+        data[3] = x >> 8;
+        data[4] = y;
+        data[5] = 0;
+
+        stream_add(stream, data, sizeof(data), SYNTHETIC_DT);
+    }
+}
+
+struct config {
+    const char *name;
+    bool filter;
+    bool map;
+    bool predict;
+};
+
+static const struct config configs[] = {
+        {"decode", false, false, false},
+        {"decode+filter", true, false, false},
+        {"decode+map", false, true, false},
+        {"decode+filter+map", true, true, false},
+        {"decode+filter+map+predict", true, true, true},
+};
+
+/* one frame at 60Hz */
+#define BENCH_LOOKAHEAD 16667
+
+/* identity scaled to a 1920x1080 screen */
+static const s32 bench_matrix[6] = {
+        (1920 << GUNCON2_Q16_SHIFT) / 545, 0, -((s64) 175 * 1920 << GUNCON2_Q16_SHIFT) / 545,
+        0, (1080 << GUNCON2_Q16_SHIFT) / 220, -((s64) 20 * 1080 << GUNCON2_Q16_SHIFT) / 220,
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Run the stream through one configuration, returns a checksum of the output */
+static u64 run(const struct stream *stream, const struct config *config, size_t total, double *ns) {
+    struct guncon2_filter filter = {0};
+    struct guncon2_predictor predictor = {0};
+    struct guncon2_report report;
+    unsigned short x, y;
+    u64 checksum = 0;
+    double start;
+    size_t i;
+
+    start = now_ns();
+    for (i = 0; i < total; i++) {
+        const struct packet *packet = &stream->packets[i % stream->count];
+
+        if (!guncon2_decode_guncon2(packet->data, packet->len, &report))
+            continue;
+
+        x = report.x;
+        y = report.y;
+        if (report.offscreen) {
+            filter.primed = false;
+            predictor.primed = false;
+        } else {
+            if (config->filter)
+                guncon2_filter_apply(&filter, packet->dt, GUNCON2_FILTER_MIN_CUTOFF, GUNCON2_FILTER_BETA, &x, &y);
+            if (config->map)
+                guncon2_map_apply(bench_matrix, 1920, 1080, &x, &y);
+            if (config->predict)
+                guncon2_predict_apply(&predictor, packet->dt, BENCH_LOOKAHEAD, x, y, &x, &y);
+        }
+
+        checksum = checksum * 31 + ((u64) x << 32 | (u64) y << 16 | report.buttons) + report.hat_x + report.hat_y;
+    }
+    *ns = now_ns() - start;
+
+    return checksum;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n packets] [-r rounds] [usbmon trace]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct stream stream = {0};
+    size_t total = 10000000;
+    unsigned int rounds = 5;
+    unsigned int i, round;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                total = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rounds = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (!total || !rounds || argc - optind > 1)
+        usage(argv[0]);
+
+    if (optind < argc) {
+        if (stream_load(&stream, argv[optind]))
+            return 1;
+        printf("replaying %zu reports from %s\n", stream.count, argv[optind]);
+    } else {
+        stream_generate(&stream, 100000);
+        printf("replaying %zu synthetic reports\n", stream.count);
+    }
+
+    for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        double best = 0, ns;
+        u64 checksum = 0;
+
+        /* the best round is the least disturbed by the rest of the system */
+        for (round = 0; round < rounds; round++) {
+            checksum = run(&stream, &configs[i], total, &ns);
+            if (!round || ns < best)
+                best = ns;
+        }
+
+        printf("%-26s %8.2f ns/packet  (checksum %016llx)\n", configs[i].name, best / total,
+               (unsigned long long) checksum);
+    }
+
+    free(stream.packets);
+    return 0;
+}
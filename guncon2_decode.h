@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Report decoding for the Namco GunCon 2 USB light gun
+ * Copyright (C) 2019-2021 beardypig <beardypig@protonmail.com>
+ *
+ * Shared by the driver and the userspace benchmark, so everything in here
+ * is pure: no locking, no allocation and no clock. The callers own all the
+ * state and pass in the time between samples.
+ */
+#ifndef _GUNCON2_DECODE_H
+#define _GUNCON2_DECODE_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define BIT(nr) (1UL << (nr))
+#define U32_MAX UINT32_MAX
+#define USEC_PER_SEC 1000000L
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) ((type) (a) < (type) (b) ? (type) (a) : (type) (b))
+#define max_t(type, a, b) ((type) (a) > (type) (b) ? (type) (a) : (type) (b))
+#define clamp_t(type, val, lo, hi) min_t(type, max_t(type, val, lo), hi)
+
+static inline u64 div_u64(u64 dividend, u32 divisor) {
+    return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor) {
+    return dividend / divisor;
+}
+#endif
+
+#include "guncon2.h"
+
+/* length of the longest input report of any supported model */
+#define GUNCON2_REPORT_LEN 6
+
+// the gun reports an X position below this when it can't see the screen
+#define GUNCON2_OFFSCREEN_X 5
+
+#define GUNCON2_DPAD_X (GUNCON2_DPAD_LEFT | GUNCON2_DPAD_RIGHT)
+#define GUNCON2_DPAD_Y (GUNCON2_DPAD_UP | GUNCON2_DPAD_DOWN)
+
+#define GUNCON2_Q16_SHIFT 16
+
+/* 1-euro filter defaults, the cutoffs are in mHz and beta in thousandths */
+#define GUNCON2_FILTER_MIN_CUTOFF 1000
+#define GUNCON2_FILTER_BETA 7
+#define GUNCON2_FILTER_D_CUTOFF 1000
+
+/* sample period limits for the filter, in microseconds */
+#define GUNCON2_FILTER_MIN_DT 1000
+#define GUNCON2_FILTER_MAX_DT 100000
+
+/* weight of each new sample in the predictor's velocity average, Q16 */
+#define GUNCON2_PREDICT_ALPHA 16384
+
+/* the predictor starts over after a gap longer than this, in microseconds */
+#define GUNCON2_PREDICT_MAX_DT 100000
+
+struct guncon2_report {
+    unsigned short x, y; // position as sent by the gun
+    u16 buttons;         // GUNCON2_* button bits
+    s8 hat_x, hat_y;     // D-pad, -1 (left/up) to 1 (right/down)
+    bool offscreen;
+};
+
+struct guncon2_filter {
+    bool primed;
+    struct guncon2_euro_axis {
+        s64 x;  // filtered position, Q16
+        s64 dx; // filtered velocity, Q16 units per second
+    } axis[2];
+};
+
+/* Fill in the fields derived from the position and buttons */
+static inline void guncon2_decode_common(struct guncon2_report *report) {
+    report->offscreen = report->x < GUNCON2_OFFSCREEN_X;
+
+    report->hat_x = !!(report->buttons & GUNCON2_DPAD_RIGHT) - !!(report->buttons & GUNCON2_DPAD_LEFT);
+    report->hat_y = !!(report->buttons & GUNCON2_DPAD_DOWN) - !!(report->buttons & GUNCON2_DPAD_UP);
+}
+
+/*
+ * Define guncon2_decode_<model>() for a report layout: the report length,
+ * the byte offsets of the 16-bit X position, the 8-bit Y position and the
+ * two button bytes, and a mask that is XORed into the buttons to make them
+ * active high. Each model gets its own decoder with the offsets as
+ * constants, so decoding does not look anything up per packet. Models must
+ * use the GUNCON2_* button bits.
+ */
+#define GUNCON2_DEFINE_DECODER(model, len, x_lo, x_hi, y_off, buttons_hi, buttons_lo, buttons_xor) \
+    static inline bool guncon2_decode_##model(const unsigned char *data, unsigned int actual_length, \
+                                              struct guncon2_report *report) {                        \
+        if (actual_length != (len))                                                                   \
+            return false;                                                                             \
+                                                                                                      \
+        report->x = (data[x_hi] << 8) | data[x_lo];                                                   \
+        report->y = data[y_off];                                                                      \
+        report->buttons = ((data[buttons_hi] << 8) | data[buttons_lo]) ^ (buttons_xor);               \
+        guncon2_decode_common(report);                                                                \
+        return true;                                                                                  \
+    }
+
+/* Namco GunCon 2, buttons in bytes 0-1 (active low), X in bytes 2-3 and Y in byte 4 */
+GUNCON2_DEFINE_DECODER(guncon2, 6, 2, 3, 4, 0, 1, 0xffff)
+
+/* Smoothing factor in Q16 for a cutoff frequency (mHz) and sample period (us) */
+static inline u32 guncon2_euro_alpha(u32 cutoff, u32 dt) {
+    /* tau = 1 / (2 * pi * fc) */
+    u32 tau = 159154943U / max(cutoff, 1U);
+
+    return div_u64((u64) dt << GUNCON2_Q16_SHIFT, dt + tau);
+}
+
+/*
+ * One step of the 1-euro filter: the position is low-pass filtered with a
+ * cutoff that rises with the (filtered) speed, so slow movement is smoothed
+ * heavily while fast movement is passed through with little lag.
+ */
+static inline unsigned short guncon2_euro_step(struct guncon2_euro_axis *axis, unsigned short value, u32 dt,
+                                               u32 min_cutoff, u32 beta) {
+    s64 x = (s64) value << GUNCON2_Q16_SHIFT;
+    s64 dx = div_s64((x - axis->x) * USEC_PER_SEC, dt);
+    u64 speed, cutoff;
+
+    axis->dx += ((dx - axis->dx) * guncon2_euro_alpha(GUNCON2_FILTER_D_CUTOFF, dt)) >> GUNCON2_Q16_SHIFT;
+
+    speed = (axis->dx < 0 ? -axis->dx : axis->dx) >> GUNCON2_Q16_SHIFT;
+    cutoff = min_cutoff + (u64) beta * speed;
+    cutoff = min_t(u64, cutoff, U32_MAX);
+
+    axis->x += ((x - axis->x) * guncon2_euro_alpha(cutoff, dt)) >> GUNCON2_Q16_SHIFT;
+
+    return (axis->x + BIT(GUNCON2_Q16_SHIFT - 1)) >> GUNCON2_Q16_SHIFT;
+}
+
+/*
+ * Filter a position, dt is the time since the previous sample in
+ * microseconds. The first sample after the filter is (re)primed passes
+ * through unchanged.
+ */
+static inline void guncon2_filter_apply(struct guncon2_filter *filter, s64 dt, u32 min_cutoff, u32 beta,
+                                        unsigned short *x, unsigned short *y) {
+    if (!filter->primed) {
+        filter->axis[0].x = (s64) *x << GUNCON2_Q16_SHIFT;
+        filter->axis[1].x = (s64) *y << GUNCON2_Q16_SHIFT;
+        filter->axis[0].dx = 0;
+        filter->axis[1].dx = 0;
+        filter->primed = true;
+        return;
+    }
+
+    dt = clamp_t(s64, dt, GUNCON2_FILTER_MIN_DT, GUNCON2_FILTER_MAX_DT);
+
+    *x = guncon2_euro_step(&filter->axis[0], *x, dt, min_cutoff, beta);
+    *y = guncon2_euro_step(&filter->axis[1], *y, dt, min_cutoff, beta);
+}
+
+struct guncon2_predictor {
+    bool primed;
+    struct guncon2_predict_axis {
+        s64 x; // last position
+        s64 v; // average velocity, Q16 units per second
+    } axis[2];
+};
+
+static inline unsigned short guncon2_predict_step(struct guncon2_predict_axis *axis, unsigned short value, u32 dt,
+                                                  u32 lookahead) {
+    s64 v = div_s64((((s64) value - axis->x) * USEC_PER_SEC) << GUNCON2_Q16_SHIFT, dt);
+    s64 p;
+
+    axis->v += ((v - axis->v) * GUNCON2_PREDICT_ALPHA) >> GUNCON2_Q16_SHIFT;
+    axis->x = value;
+
+    p = value + (div_s64(axis->v * lookahead, USEC_PER_SEC) >> GUNCON2_Q16_SHIFT);
+    return clamp_t(s64, p, 0, 0xffff);
+}
+
+/*
+ * Dead reckoning: extrapolate a position lookahead microseconds ahead from
+ * the average velocity, dt is the time since the previous sample in
+ * microseconds. The first sample after the predictor is (re)primed and
+ * samples after a long gap are passed through unchanged.
+ */
+static inline void guncon2_predict_apply(struct guncon2_predictor *pred, s64 dt, u32 lookahead, unsigned short x,
+                                         unsigned short y, unsigned short *px, unsigned short *py) {
+    if (!pred->primed || dt > GUNCON2_PREDICT_MAX_DT) {
+        pred->axis[0].x = x;
+        pred->axis[1].x = y;
+        pred->axis[0].v = 0;
+        pred->axis[1].v = 0;
+        pred->primed = true;
+        *px = x;
+        *py = y;
+        return;
+    }
+
+    dt = max_t(s64, dt, GUNCON2_FILTER_MIN_DT);
+
+    *px = guncon2_predict_step(&pred->axis[0], x, dt, lookahead);
+    *py = guncon2_predict_step(&pred->axis[1], y, dt, lookahead);
+}
+
+/*
+ * Apply an affine calibration, m is Q16 fixed point with
+ * x' = m0*x + m1*y + m2 and y' = m3*x + m4*y + m5. The result is clamped to
+ * the screen size the matrix was loaded with.
+ */
+static inline void guncon2_map_apply(const s32 *m, u16 width, u16 height, unsigned short *x, unsigned short *y) {
+    s64 sx, sy;
+
+    sx = ((s64) m[0] * *x + (s64) m[1] * *y + m[2]) >> GUNCON2_Q16_SHIFT;
+    sy = ((s64) m[3] * *x + (s64) m[4] * *y + m[5]) >> GUNCON2_Q16_SHIFT;
+    *x = clamp_t(s64, sx, 0, width - 1);
+    *y = clamp_t(s64, sy, 0, height - 1);
+}
+
+#endif /* _GUNCON2_DECODE_H */
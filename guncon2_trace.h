@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the Namco GunCon 2 USB light gun driver
+ * Copyright (C) 2019-2021 beardypig <beardypig@protonmail.com>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM guncon2
+
+#if !defined(_GUNCON2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GUNCON2_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+TRACE_EVENT(guncon2_urb_complete,
+            TP_PROTO(struct urb *urb, int frame),
+            TP_ARGS(urb, frame),
+
+            TP_STRUCT__entry(
+                    __field(int, busnum)
+                    __field(int, devnum)
+                    __field(int, status)
+                    __field(u32, length)
+                    __field(int, frame)),
+
+            TP_fast_assign(
+                    __entry->busnum = urb->dev->bus->busnum;
+                    __entry->devnum = urb->dev->devnum;
+                    __entry->status = urb->status;
+                    __entry->length = urb->actual_length;
+                    __entry->frame = frame;),
+
+            TP_printk("%03d:%03d status=%d length=%u frame=%d",
+                      __entry->busnum, __entry->devnum, __entry->status,
+                      __entry->length, __entry->frame));
+
+TRACE_EVENT(guncon2_report,
+            TP_PROTO(struct urb *urb, u16 x, u16 y, u16 buttons),
+            TP_ARGS(urb, x, y, buttons),
+
+            TP_STRUCT__entry(
+                    __field(int, busnum)
+                    __field(int, devnum)
+                    __field(u16, x)
+                    __field(u16, y)
+                    __field(u16, buttons)),
+
+            TP_fast_assign(
+                    __entry->busnum = urb->dev->bus->busnum;
+                    __entry->devnum = urb->dev->devnum;
+                    __entry->x = x;
+                    __entry->y = y;
+                    __entry->buttons = buttons;),
+
+            TP_printk("%03d:%03d x=%u y=%u buttons=0x%04x",
+                      __entry->busnum, __entry->devnum, __entry->x,
+                      __entry->y, __entry->buttons));
+
+TRACE_EVENT(guncon2_resubmit,
+            TP_PROTO(struct urb *urb, int error),
+            TP_ARGS(urb, error),
+
+            TP_STRUCT__entry(
+                    __field(int, busnum)
+                    __field(int, devnum)
+                    __field(int, error)),
+
+            TP_fast_assign(
+                    __entry->busnum = urb->dev->bus->busnum;
+                    __entry->devnum = urb->dev->devnum;
+                    __entry->error = error;),
+
+            TP_printk("%03d:%03d error=%d",
+                      __entry->busnum, __entry->devnum, __entry->error));
+
+TRACE_EVENT(guncon2_backoff,
+            TP_PROTO(struct urb *urb, int status, unsigned int delay_ms),
+            TP_ARGS(urb, status, delay_ms),
+
+            TP_STRUCT__entry(
+                    __field(int, busnum)
+                    __field(int, devnum)
+                    __field(int, status)
+                    __field(unsigned int, delay_ms)),
+
+            TP_fast_assign(
+                    __entry->busnum = urb->dev->bus->busnum;
+                    __entry->devnum = urb->dev->devnum;
+                    __entry->status = status;
+                    __entry->delay_ms = delay_ms;),
+
+            TP_printk("%03d:%03d status=%d delay=%ums",
+                      __entry->busnum, __entry->devnum, __entry->status,
+                      __entry->delay_ms));
+
+TRACE_EVENT(guncon2_first_event,
+            TP_PROTO(struct urb *urb, s64 report_us, s64 event_us),
+            TP_ARGS(urb, report_us, event_us),
+
+            TP_STRUCT__entry(
+                    __field(int, busnum)
+                    __field(int, devnum)
+                    __field(s64, report_us)
+                    __field(s64, event_us)),
+
+            TP_fast_assign(
+                    __entry->busnum = urb->dev->bus->busnum;
+                    __entry->devnum = urb->dev->devnum;
+                    __entry->report_us = report_us;
+                    __entry->event_us = event_us;),
+
+            TP_printk("%03d:%03d first_report=%lldus first_event=%lldus",
+                      __entry->busnum, __entry->devnum, __entry->report_us,
+                      __entry->event_us));
+
+#endif /* _GUNCON2_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE guncon2_trace
+
+#include <trace/define_trace.h>
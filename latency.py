@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""
+End-to-end latency of the GunCon 2, point the gun at the screen and run
+
+    ./latency.py
+
+The screen is kept black until the gun reports that it is off-screen, then it is flashed white on a vblank. The time
+from the flip to the first on-screen position is the display-to-sample latency: display scan-out, the sensor, the USB
+polling interval and the driver. Event timestamps are the URB completion times, so the time from the event timestamp to
+the event being read is the time spent in the driver, the input core and waking up the reader. Pull the trigger now and
+then to measure trigger edges as well.
+"""
+import argparse
+import fcntl
+import logging
+import os
+import selectors
+import struct
+import sys
+import threading
+import time
+from queue import Queue, Empty
+
+import numpy as np
+import pygame
+from evdev import ecodes
+
+from calibrate import find_guncons, log
+
+# _IOW('E', 0xa0, int)
+EVIOCSCLOCKID = 0x400445a0
+
+BLACK = (0, 0, 0)
+WHITE = (255, 255, 255)
+
+
+def set_clock(device, clock):
+    """Timestamp the events with a clock other than CLOCK_REALTIME"""
+    fcntl.ioctl(device.fd, EVIOCSCLOCKID, struct.pack("i", clock))
+
+
+def percentiles(values):
+    """(count, p50, p99, max), in microseconds"""
+    if not values:
+        return 0, 0.0, 0.0, 0.0
+    us = np.asarray(values) * 1e6
+    return len(us), float(np.percentile(us, 50)), float(np.percentile(us, 99)), float(us.max())
+
+
+def report(name, values):
+    count, p50, p99, worst = percentiles(values)
+    print(f"{name:<20} n={count:<6} p50={p50:9.1f}us  p99={p99:9.1f}us  max={worst:9.1f}us")
+
+
+def read_events(guncon, events, stop):
+    """Read the gun on its own thread, so the reads are not held up by the flips"""
+    selector = selectors.DefaultSelector()
+    selector.register(guncon, selectors.EVENT_READ)
+    while not stop.is_set():
+        if not selector.select(0.1):
+            continue
+        for shot, buttons in guncon.update():
+            events.put((time.monotonic(), shot, buttons))
+
+
+def debugfs_histogram(guncon, name):
+    """A histogram from the driver's debugfs statistics, or None if debugfs is not readable"""
+    interface = os.path.basename(os.path.realpath(guncon.sysfs_path))
+    try:
+        with open(os.path.join("/sys/kernel/debug/guncon2", interface, name)) as f:
+            return f.read()
+    except OSError:
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measure the display-to-sample and event delivery latency")
+    parser.add_argument("-r", "--resolution", default=None,
+                        help="screen resolution, eg. 1920x1080 (default: the desktop resolution)")
+    parser.add_argument("-n", "--flashes", default=200, type=int, help="number of flashes")
+    parser.add_argument("--dark", default=100, type=int,
+                        help="least time in ms the screen is black, after the gun has gone off-screen")
+    parser.add_argument("--timeout", default=500, type=int,
+                        help="time in ms to wait for the gun to see a flash before it is counted as missed")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO)
+
+    guncons = find_guncons()
+    if not guncons:
+        sys.stderr.write("Failed to find any attached GunCon2 devices")
+        return 1
+    guncon = guncons[0]
+
+    # compare the event timestamps with time.monotonic()
+    set_clock(guncon.device, time.CLOCK_MONOTONIC)
+
+    pygame.init()
+    if args.resolution:
+        w, h = args.resolution.split("x")
+        size = int(w), int(h)
+    else:
+        size = (0, 0)
+    # with vsync the flip returns at the vblank the new frame is shown from
+    screen = pygame.display.set_mode(size, pygame.FULLSCREEN | pygame.SCALED, vsync=1)
+    pygame.display.set_caption("GunCon 2 latency")
+    pygame.mouse.set_visible(False)
+
+    events = Queue()
+    stop = threading.Event()
+    display, position, trigger = [], [], []
+    missed = 0
+
+    with guncon.device.grab_context():
+        reader = threading.Thread(target=read_events, args=(guncon, events, stop), daemon=True)
+        reader.start()
+
+        flash = None  # flip time of the white frame
+        dark_since = None  # time the gun went off-screen during the black frame
+        running = True
+
+        try:
+            while running and len(display) + missed < args.flashes:
+                for event in pygame.event.get():
+                    if event.type == pygame.QUIT or (event.type == pygame.KEYDOWN and event.key == pygame.K_q):
+                        running = False
+
+                screen.fill(WHITE if flash is not None else BLACK)
+                pygame.display.flip()
+                flipped = time.monotonic()
+                if flash is None and dark_since is not None and flipped - dark_since >= args.dark / 1000.0:
+                    # the next frame is the flash
+                    screen.fill(WHITE)
+                    pygame.display.flip()
+                    flash = time.monotonic()
+
+                while True:
+                    try:
+                        read, shot, buttons = events.get_nowait()
+                    except Empty:
+                        break
+
+                    position.append(read - shot.time)
+                    for button, value in buttons:
+                        if button == ecodes.BTN_LEFT:
+                            trigger.append(read - shot.time)
+
+                    if flash is None:
+                        if shot.offscreen and dark_since is None:
+                            dark_since = shot.time
+                    elif not shot.offscreen and shot.time >= flash:
+                        display.append(shot.time - flash)
+                        flash = dark_since = None
+
+                if flash is not None and time.monotonic() - flash >= args.timeout / 1000.0:
+                    log.warning("The gun did not see the flash, is it pointed at the screen?")
+                    missed += 1
+                    flash = dark_since = None
+        finally:
+            stop.set()
+            reader.join()
+            pygame.quit()
+
+    print(f"{len(display)} flashes, {missed} missed")
+    report("display to sample", display)
+    report("position delivery", position)
+    report("trigger delivery", trigger)
+
+    histogram = debugfs_histogram(guncon, "process_histogram")
+    if histogram:
+        print("\ndriver time from URB completion to input_sync:")
+        print(histogram, end="")
+
+
+if __name__ == "__main__":
+    sys.exit(main() or 0)